@@ -213,7 +213,7 @@ class JanusNdiHandle extends Handle {
 	}
 
 	/* Setup a new WebRTC PeerConnection to translate to NDI */
-	async translate({ name, metadata, width, height, fps, strict, onDisconnect, videocodec, jsep = null }) {
+	async translate({ name, metadata, width, height, fps, strict, buffer, decoderThreads, decoderThreading, outputFormat, audioFrameSize, onDisconnect, videocodec, jsep = null }) {
 		const body = {
 			request: REQUEST_TRANSLATE,
 			name,
@@ -228,6 +228,16 @@ class JanusNdiHandle extends Handle {
 			body.fps = fps;
 		if(typeof strict === 'boolean')
 			body.strict = strict;
+		if(typeof buffer === 'number')
+			body.buffer = buffer;
+		if(typeof decoderThreads === 'number')
+			body.decoder_threads = decoderThreads;
+		if(typeof decoderThreading === 'string')
+			body.decoder_threading = decoderThreading;
+		if(typeof outputFormat === 'string')
+			body.output_format = outputFormat;
+		if(typeof audioFrameSize === 'number')
+			body.audio_frame_size = audioFrameSize;
 		if(typeof onDisconnect === 'object' && onDisconnect)
 			body.ondisconnect = onDisconnect;
 		if(typeof videocodec === 'string')
@@ -242,7 +252,7 @@ class JanusNdiHandle extends Handle {
 	}
 
 	/* Configure an established WebRTC PeerConnection */
-	async configure({ keyframe, bitrate, paused }) {
+	async configure({ keyframe, bitrate, paused, buffer }) {
 		const body = {
 			request: REQUEST_CONFIGURE,
 		};
@@ -252,6 +262,8 @@ class JanusNdiHandle extends Handle {
 			body.bitrate = bitrate;
 		if(typeof paused === 'boolean')
 			body.paused = paused;
+		if(typeof buffer === 'number')
+			body.buffer = buffer;
 
 		const response = await this.message(body);
 		const { event, data: evtdata } = this._getPluginEvent(response);
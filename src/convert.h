@@ -0,0 +1,225 @@
+#ifndef _CONVERT_H_
+#define _CONVERT_H_
+
+/* Kernels to pack planar YUV 4:2:0 frames to UYVY, either as they are
+ * or downscaled by half, which are the cases we find most often when
+ * translating to NDI: the best implementation the CPU supports is
+ * picked at startup, and the plain C versions act as a reference */
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define JANUS_NDI_CONVERT_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define JANUS_NDI_CONVERT_NEON
+#endif
+
+/* Packs a row of width pixels (width must be even) */
+typedef void (*janus_ndi_pack_row)(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+	uint8_t *dst, int width);
+/* Packs a row of width pixels (width must be even), averaging 2x2 blocks
+ * of the two source luma rows, and pairs of the source chroma samples */
+typedef void (*janus_ndi_pack_half_row)(const uint8_t *y0, const uint8_t *y1,
+	const uint8_t *u, const uint8_t *v, uint8_t *dst, int width);
+
+/* Rounded average, as done by the SIMD instructions we use */
+#define JANUS_NDI_AVG(a, b) (((a) + (b) + 1) >> 1)
+
+static void janus_ndi_pack_row_c(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+		uint8_t *dst, int width) {
+	int i = 0;
+	for(i=0; i<width/2; i++) {
+		*dst++ = u[i];
+		*dst++ = y[2*i];
+		*dst++ = v[i];
+		*dst++ = y[2*i+1];
+	}
+}
+static void janus_ndi_pack_half_row_c(const uint8_t *y0, const uint8_t *y1,
+		const uint8_t *u, const uint8_t *v, uint8_t *dst, int width) {
+	int i = 0;
+	for(i=0; i<width/2; i++) {
+		*dst++ = JANUS_NDI_AVG(u[2*i], u[2*i+1]);
+		*dst++ = JANUS_NDI_AVG(JANUS_NDI_AVG(y0[4*i], y1[4*i]), JANUS_NDI_AVG(y0[4*i+1], y1[4*i+1]));
+		*dst++ = JANUS_NDI_AVG(v[2*i], v[2*i+1]);
+		*dst++ = JANUS_NDI_AVG(JANUS_NDI_AVG(y0[4*i+2], y1[4*i+2]), JANUS_NDI_AVG(y0[4*i+3], y1[4*i+3]));
+	}
+}
+
+#ifdef JANUS_NDI_CONVERT_X86
+__attribute__((target("sse2")))
+static void janus_ndi_pack_row_sse2(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+		uint8_t *dst, int width) {
+	int i = 0;
+	for(i=0; i+16<=width; i+=16) {
+		__m128i yy = _mm_loadu_si128((const __m128i *)(y + i));
+		__m128i uv = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(u + i/2)),
+			_mm_loadl_epi64((const __m128i *)(v + i/2)));
+		_mm_storeu_si128((__m128i *)(dst + 2*i), _mm_unpacklo_epi8(uv, yy));
+		_mm_storeu_si128((__m128i *)(dst + 2*i + 16), _mm_unpackhi_epi8(uv, yy));
+	}
+	janus_ndi_pack_row_c(y + i, u + i/2, v + i/2, dst + 2*i, width - i);
+}
+__attribute__((target("sse2")))
+static void janus_ndi_pack_half_row_sse2(const uint8_t *y0, const uint8_t *y1,
+		const uint8_t *u, const uint8_t *v, uint8_t *dst, int width) {
+	const __m128i mask = _mm_set1_epi16(0x00ff);
+	int i = 0;
+	for(i=0; i+16<=width; i+=16) {
+		/* Vertical average first, then horizontal */
+		__m128i l0 = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(y0 + 2*i)),
+			_mm_loadu_si128((const __m128i *)(y1 + 2*i)));
+		__m128i l1 = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(y0 + 2*i + 16)),
+			_mm_loadu_si128((const __m128i *)(y1 + 2*i + 16)));
+		__m128i yy = _mm_packus_epi16(
+			_mm_avg_epu16(_mm_and_si128(l0, mask), _mm_srli_epi16(l0, 8)),
+			_mm_avg_epu16(_mm_and_si128(l1, mask), _mm_srli_epi16(l1, 8)));
+		__m128i cu = _mm_loadu_si128((const __m128i *)(u + i));
+		__m128i cv = _mm_loadu_si128((const __m128i *)(v + i));
+		__m128i uv = _mm_or_si128(
+			_mm_avg_epu16(_mm_and_si128(cu, mask), _mm_srli_epi16(cu, 8)),
+			_mm_slli_epi16(_mm_avg_epu16(_mm_and_si128(cv, mask), _mm_srli_epi16(cv, 8)), 8));
+		_mm_storeu_si128((__m128i *)(dst + 2*i), _mm_unpacklo_epi8(uv, yy));
+		_mm_storeu_si128((__m128i *)(dst + 2*i + 16), _mm_unpackhi_epi8(uv, yy));
+	}
+	janus_ndi_pack_half_row_c(y0 + 2*i, y1 + 2*i, u + i, v + i, dst + 2*i, width - i);
+}
+__attribute__((target("avx2")))
+static void janus_ndi_pack_row_avx2(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+		uint8_t *dst, int width) {
+	int i = 0;
+	for(i=0; i+32<=width; i+=32) {
+		__m256i yy = _mm256_loadu_si256((const __m256i *)(y + i));
+		__m128i cu = _mm_loadu_si128((const __m128i *)(u + i/2));
+		__m128i cv = _mm_loadu_si128((const __m128i *)(v + i/2));
+		/* Lanes can't be crossed, so each one gets the chroma for its own luma */
+		__m256i uv = _mm256_set_m128i(_mm_unpackhi_epi8(cu, cv), _mm_unpacklo_epi8(cu, cv));
+		__m256i lo = _mm256_unpacklo_epi8(uv, yy);
+		__m256i hi = _mm256_unpackhi_epi8(uv, yy);
+		_mm256_storeu_si256((__m256i *)(dst + 2*i), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(dst + 2*i + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	janus_ndi_pack_row_sse2(y + i, u + i/2, v + i/2, dst + 2*i, width - i);
+}
+__attribute__((target("avx2")))
+static void janus_ndi_pack_half_row_avx2(const uint8_t *y0, const uint8_t *y1,
+		const uint8_t *u, const uint8_t *v, uint8_t *dst, int width) {
+	const __m256i mask = _mm256_set1_epi16(0x00ff);
+	int i = 0;
+	for(i=0; i+32<=width; i+=32) {
+		__m256i l0 = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)(y0 + 2*i)),
+			_mm256_loadu_si256((const __m256i *)(y1 + 2*i)));
+		__m256i l1 = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)(y0 + 2*i + 32)),
+			_mm256_loadu_si256((const __m256i *)(y1 + 2*i + 32)));
+		__m256i yy = _mm256_packus_epi16(
+			_mm256_avg_epu16(_mm256_and_si256(l0, mask), _mm256_srli_epi16(l0, 8)),
+			_mm256_avg_epu16(_mm256_and_si256(l1, mask), _mm256_srli_epi16(l1, 8)));
+		/* Packing works per lane, put the luma back in order */
+		yy = _mm256_permute4x64_epi64(yy, 0xD8);
+		__m256i cu = _mm256_loadu_si256((const __m256i *)(u + i));
+		__m256i cv = _mm256_loadu_si256((const __m256i *)(v + i));
+		__m256i uv = _mm256_or_si256(
+			_mm256_avg_epu16(_mm256_and_si256(cu, mask), _mm256_srli_epi16(cu, 8)),
+			_mm256_slli_epi16(_mm256_avg_epu16(_mm256_and_si256(cv, mask), _mm256_srli_epi16(cv, 8)), 8));
+		__m256i lo = _mm256_unpacklo_epi8(uv, yy);
+		__m256i hi = _mm256_unpackhi_epi8(uv, yy);
+		_mm256_storeu_si256((__m256i *)(dst + 2*i), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(dst + 2*i + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	janus_ndi_pack_half_row_sse2(y0 + 2*i, y1 + 2*i, u + i, v + i, dst + 2*i, width - i);
+}
+#endif
+
+#ifdef JANUS_NDI_CONVERT_NEON
+static void janus_ndi_pack_row_neon(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+		uint8_t *dst, int width) {
+	int i = 0;
+	for(i=0; i+32<=width; i+=32) {
+		uint8x16x2_t yy = vld2q_u8(y + i);
+		uint8x16x4_t uyvy;
+		uyvy.val[0] = vld1q_u8(u + i/2);
+		uyvy.val[1] = yy.val[0];
+		uyvy.val[2] = vld1q_u8(v + i/2);
+		uyvy.val[3] = yy.val[1];
+		vst4q_u8(dst + 2*i, uyvy);
+	}
+	janus_ndi_pack_row_c(y + i, u + i/2, v + i/2, dst + 2*i, width - i);
+}
+static void janus_ndi_pack_half_row_neon(const uint8_t *y0, const uint8_t *y1,
+		const uint8_t *u, const uint8_t *v, uint8_t *dst, int width) {
+	int i = 0;
+	for(i=0; i+16<=width; i+=16) {
+		/* Split even and odd columns, so that averaging them is trivial */
+		uint8x16x2_t a = vld2q_u8(y0 + 2*i);
+		uint8x16x2_t b = vld2q_u8(y1 + 2*i);
+		uint8x16_t yy = vrhaddq_u8(vrhaddq_u8(a.val[0], b.val[0]), vrhaddq_u8(a.val[1], b.val[1]));
+		uint8x8x2_t cu = vld2_u8(u + i);
+		uint8x8x2_t cv = vld2_u8(v + i);
+		uint8x8x2_t split = vuzp_u8(vget_low_u8(yy), vget_high_u8(yy));
+		uint8x8x4_t uyvy;
+		uyvy.val[0] = vrhadd_u8(cu.val[0], cu.val[1]);
+		uyvy.val[1] = split.val[0];
+		uyvy.val[2] = vrhadd_u8(cv.val[0], cv.val[1]);
+		uyvy.val[3] = split.val[1];
+		vst4_u8(dst + 2*i, uyvy);
+	}
+	janus_ndi_pack_half_row_c(y0 + 2*i, y1 + 2*i, u + i, v + i, dst + 2*i, width - i);
+}
+#endif
+
+/* Conversion kernels in use */
+typedef struct janus_ndi_convert_kernels {
+	const char *name;
+	janus_ndi_pack_row pack;
+	janus_ndi_pack_half_row pack_half;
+} janus_ndi_convert_kernels;
+static janus_ndi_convert_kernels janus_ndi_convert_c = {
+	"c", janus_ndi_pack_row_c, janus_ndi_pack_half_row_c
+};
+static janus_ndi_convert_kernels janus_ndi_convert = {
+	"c", janus_ndi_pack_row_c, janus_ndi_pack_half_row_c
+};
+
+/* Pick the best kernels the CPU supports */
+static void janus_ndi_convert_init(void) {
+#if defined(JANUS_NDI_CONVERT_X86)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		janus_ndi_convert.name = "avx2";
+		janus_ndi_convert.pack = janus_ndi_pack_row_avx2;
+		janus_ndi_convert.pack_half = janus_ndi_pack_half_row_avx2;
+	} else if(__builtin_cpu_supports("sse2")) {
+		janus_ndi_convert.name = "sse2";
+		janus_ndi_convert.pack = janus_ndi_pack_row_sse2;
+		janus_ndi_convert.pack_half = janus_ndi_pack_half_row_sse2;
+	}
+#elif defined(JANUS_NDI_CONVERT_NEON)
+	/* NEON is always available on AArch64 */
+	janus_ndi_convert.name = "neon";
+	janus_ndi_convert.pack = janus_ndi_pack_row_neon;
+	janus_ndi_convert.pack_half = janus_ndi_pack_half_row_neon;
+#endif
+}
+
+/* Pack a whole 4:2:0 frame, as it is or downscaled by half (in which case
+ * width and height refer to the source, and must be multiples of 4 and 2) */
+static void janus_ndi_convert_frame(janus_ndi_convert_kernels *k, int half,
+		uint8_t *const src[3], const int src_stride[3], uint8_t *dst, int dst_stride,
+		int width, int height) {
+	int y = 0;
+	if(!half) {
+		for(y=0; y<height; y++) {
+			k->pack(src[0] + y*src_stride[0], src[1] + (y/2)*src_stride[1],
+				src[2] + (y/2)*src_stride[2], dst + y*dst_stride, width);
+		}
+	} else {
+		for(y=0; y<height/2; y++) {
+			k->pack_half(src[0] + 2*y*src_stride[0], src[0] + (2*y+1)*src_stride[0],
+				src[1] + y*src_stride[1], src[2] + y*src_stride[2], dst + y*dst_stride, width/2);
+		}
+	}
+}
+
+#endif
@@ -6,6 +6,7 @@
 #include <janus/plugins/plugin.h>
 
 #include <sys/time.h>
+#include <math.h>
 #include <jansson.h>
 #include <curl/curl.h>
 
@@ -13,9 +14,11 @@
 #include <opus/opus.h>
 #include <libavutil/avutil.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/opt.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libswresample/swresample.h>
 #include <libswscale/swscale.h>
 
 #include <janus/debug.h>
@@ -29,6 +32,8 @@
 
 /* The PNG test pattern as a header file */
 #include "pattern.h"
+/* Our own YUV to UYVY conversion kernels */
+#include "convert.h"
 
 /* VP8 stuff */
 #if defined(__ppc__) || defined(__ppc64__)
@@ -134,6 +139,11 @@ static struct janus_json_parameter translate_parameters[] = {
 	{"audio", JANUS_JSON_BOOL, 0},
 	{"video", JANUS_JSON_BOOL, 0},
 	{"strict", JANUS_JSON_BOOL, 0},
+	{"buffer", JSON_INTEGER, 0},
+	{"decoder_threads", JSON_INTEGER, JANUS_JSON_PARAM_POSITIVE},
+	{"decoder_threading", JSON_STRING, 0},
+	{"output_format", JSON_STRING, 0},
+	{"audio_frame_size", JSON_INTEGER, JANUS_JSON_PARAM_POSITIVE},
 };
 static struct janus_json_parameter ondisconnect_parameters[] = {
 	{"image", JSON_STRING, JANUS_JSON_PARAM_REQUIRED},
@@ -145,6 +155,7 @@ static struct janus_json_parameter configure_parameters[] = {
 	{"paused", JANUS_JSON_BOOL, 0},
 	{"audio", JANUS_JSON_BOOL, 0},
 	{"video", JANUS_JSON_BOOL, 0},
+	{"buffer", JSON_INTEGER, 0},
 };
 
 /* Useful stuff */
@@ -157,6 +168,132 @@ static void *janus_ndi_handler(void *data);
 
 /* Default buffer size in ms */
 static int64_t buffer_size = 200000;
+/* Whether sessions should size their own buffer according to the network
+ * conditions, and if so within which bounds */
+static gboolean adaptive_buffer = FALSE;
+static int64_t buffer_min = 20000, buffer_max = 1000000;
+/* Maximum size of a video frame we'll reassemble, in bytes */
+static int frame_buffer_max = 4*1024*1024;
+/* Number of media workers (0 means one per core) */
+static guint num_workers = 0;
+/* Whether video frames should be sent to NDI asynchronously */
+static gboolean async_send = TRUE;
+/* Whether we should compensate the clock drift of senders, resampling audio
+ * and repeating or dropping video frames (when the frame rate is known) */
+static gboolean drift_compensation = TRUE;
+/* Duration of the audio frames we send to NDI, in ms (0 means we send
+ * one frame per Opus packet, whatever its duration) */
+#define JANUS_NDI_AUDIO_FRAME_MIN	5
+#define JANUS_NDI_AUDIO_FRAME_MAX	120
+static int audio_frame_size = 0;
+/* How we ask senders for keyframes: PLIs, FIRs, or PLIs first and FIRs
+ * when they go unanswered (some senders only honour one of the two) */
+typedef enum janus_ndi_keyframe_method {
+	JANUS_NDI_KEYFRAME_PLI,
+	JANUS_NDI_KEYFRAME_FIR,
+	JANUS_NDI_KEYFRAME_AUTO
+} janus_ndi_keyframe_method;
+static janus_ndi_keyframe_method keyframe_method = JANUS_NDI_KEYFRAME_AUTO;
+/* Unanswered keyframe requests make a session back off exponentially, and
+ * in auto mode we switch to FIRs after a couple of unanswered PLIs */
+#define JANUS_NDI_KEYFRAME_BACKOFF_MIN	(G_USEC_PER_SEC/2)
+#define JANUS_NDI_KEYFRAME_BACKOFF_MAX	(8*G_USEC_PER_SEC)
+#define JANUS_NDI_KEYFRAME_FIR_AFTER	2
+/* Keyframe requests per second all sessions can send together (0 means no
+ * limit), so that a network blip doesn't have all of them ask the same
+ * upstream for a keyframe at once: it's a bucket holding a second's worth */
+static int keyframe_budget = 20;
+static double keyframe_tokens = 0;
+static gint64 keyframe_tokens_updated = 0;
+static janus_mutex keyframe_mutex = JANUS_MUTEX_INITIALIZER;
+static int janus_ndi_keyframe_method_from_name(const char *name) {
+	if(name == NULL)
+		return -1;
+	if(!strcasecmp(name, "pli"))
+		return JANUS_NDI_KEYFRAME_PLI;
+	if(!strcasecmp(name, "fir"))
+		return JANUS_NDI_KEYFRAME_FIR;
+	if(!strcasecmp(name, "auto"))
+		return JANUS_NDI_KEYFRAME_AUTO;
+	return -1;
+}
+/* Format to send video frames in: UYVY is what all receivers support, and
+ * what we fall back to when I420 or NV12 can't be used (frames that need
+ * scaling or have a higher bit depth); P216 preserves higher bit depths */
+static enum AVPixelFormat output_format = AV_PIX_FMT_UYVY422;
+static enum AVPixelFormat janus_ndi_output_format_from_name(const char *name) {
+	if(name == NULL)
+		return AV_PIX_FMT_NONE;
+	if(!strcasecmp(name, "uyvy"))
+		return AV_PIX_FMT_UYVY422;
+	if(!strcasecmp(name, "i420"))
+		return AV_PIX_FMT_YUV420P;
+	if(!strcasecmp(name, "nv12"))
+		return AV_PIX_FMT_NV12;
+#ifdef AV_PIX_FMT_P216
+	if(!strcasecmp(name, "p216"))
+		return AV_PIX_FMT_P216;
+#endif
+	return AV_PIX_FMT_NONE;
+}
+static const char *janus_ndi_output_format_name(enum AVPixelFormat format) {
+	if(format == AV_PIX_FMT_YUV420P)
+		return "i420";
+	if(format == AV_PIX_FMT_NV12)
+		return "nv12";
+#ifdef AV_PIX_FMT_P216
+	if(format == AV_PIX_FMT_P216)
+		return "p216";
+#endif
+	return "uyvy";
+}
+/* Whether we should use our own kernels, rather than swscale, for the
+ * conversions they support, and whether we should compare them at startup */
+static gboolean fast_conversion = TRUE, benchmark_conversion = FALSE;
+static void janus_ndi_convert_check(void);
+static void janus_ndi_convert_benchmark(void);
+/* Video decoder threading, per codec: by default we use a single thread,
+ * as frame threading adds a frame of latency per thread, and slice
+ * threading only helps with streams that were encoded with slices; since
+ * the number of threads can come from the API, we put a cap on it */
+#define JANUS_NDI_DECODER_THREADS_MAX	16
+typedef struct janus_ndi_decoder_threading {
+	janus_videocodec vcodec;	/* Codec these settings apply to */
+	int threads;				/* Number of threads (0 means one per core) */
+	int type;					/* FF_THREAD_FRAME and/or FF_THREAD_SLICE */
+} janus_ndi_decoder_threading;
+static janus_ndi_decoder_threading decoder_threading[] = {
+	{ JANUS_VIDEOCODEC_VP8, 1, FF_THREAD_FRAME | FF_THREAD_SLICE },
+	{ JANUS_VIDEOCODEC_VP9, 1, FF_THREAD_FRAME | FF_THREAD_SLICE },
+	{ JANUS_VIDEOCODEC_H264, 1, FF_THREAD_FRAME | FF_THREAD_SLICE },
+	{ JANUS_VIDEOCODEC_AV1, 1, FF_THREAD_FRAME | FF_THREAD_SLICE },
+};
+static janus_ndi_decoder_threading *janus_ndi_decoder_threading_find(janus_videocodec vcodec) {
+	size_t i = 0;
+	for(i=0; i<sizeof(decoder_threading)/sizeof(*decoder_threading); i++) {
+		if(decoder_threading[i].vcodec == vcodec)
+			return &decoder_threading[i];
+	}
+	return NULL;
+}
+static int janus_ndi_decoder_threading_type(const char *name) {
+	if(name == NULL)
+		return -1;
+	if(!strcasecmp(name, "frame"))
+		return FF_THREAD_FRAME;
+	if(!strcasecmp(name, "slice"))
+		return FF_THREAD_SLICE;
+	if(!strcasecmp(name, "auto"))
+		return FF_THREAD_FRAME | FF_THREAD_SLICE;
+	return -1;
+}
+static const char *janus_ndi_decoder_threading_name(int type) {
+	if(type == FF_THREAD_FRAME)
+		return "frame";
+	if(type == FF_THREAD_SLICE)
+		return "slice";
+	return "none";
+}
 /* Test pattern stuff */
 static AVFrame *test_pattern = NULL;
 static const char *test_pattern_name = "janus-ndi-test";
@@ -175,75 +312,875 @@ static AVFrame *janus_ndi_blit_frameYUV(AVFrame *dst, AVFrame *src,
 static AVFrame *janus_ndi_generate_disconnected_image(const char *path,
 	const char *color, int width, int height);
 
-/* Buffered audio/video packet */
+/* Buffered audio/video packet: packets are normally taken from a per-session
+ * pool of MTU-sized slots, and only allocated on the heap when they're too
+ * large or when the pool is exhausted */
+#define JANUS_NDI_PACKET_SLOT_SIZE	1500
+struct janus_ndi_packet_pool;
 typedef struct janus_ndi_buffer_packet {
 	char *buffer;			/* Pointer to the packet data, if RTP */
 	int len;				/* Size of the packet */
+	int payload;			/* Offset of the RTP payload in the packet */
+	int plen;				/* Size of the RTP payload */
+	gboolean marker;		/* Whether the RTP marker bit is set */
 	uint32_t timestamp;		/* RTP timestamp of the packet */
 	uint16_t seq_number;	/* RTP sequence number of the packet */
 	int64_t inserted;		/* Monotonic insert time */
+	struct janus_ndi_packet_pool *pool;		/* Pool this packet belongs to, if any */
+	char data[JANUS_NDI_PACKET_SLOT_SIZE];	/* Storage for pooled packets */
 } janus_ndi_buffer_packet;
-static janus_ndi_buffer_packet *janus_ndi_buffer_packet_create(char *buffer, int len) {
-	janus_ndi_buffer_packet *pkt = g_malloc(sizeof(janus_ndi_buffer_packet));
-	pkt->buffer = g_malloc(len);
+static void janus_ndi_buffer_packet_destroy(janus_ndi_buffer_packet *pkt);
+
+/* Jitter buffer, indexed by sequence number: each packet goes in the slot
+ * matching its sequence number modulo the buffer size, which means
+ * insertion, duplicate detection and gap detection are all O(1) */
+#define JANUS_NDI_AUDIO_JB_SIZE		512
+#define JANUS_NDI_VIDEO_JB_SIZE		4096
+/* Buffers grow when they're full (e.g., a long buffer on a high bitrate
+ * stream), but only up to a point: packets further ahead than that reset
+ * the buffer, so we cap the buffer size sessions can ask for too (at the
+ * maximum size, the audio slots cover ~10s of 5ms Opus packets, and the
+ * video ones ~5s at 30mbps) */
+#define JANUS_NDI_AUDIO_JB_MAX_SIZE	2048
+#define JANUS_NDI_VIDEO_JB_MAX_SIZE	16384
+#define JANUS_NDI_BUFFER_MAX_MS		5000
+/* Clock drift is measured by looking at how the smallest transit time
+ * (arrival time minus media time) in each window changes over a few
+ * windows: anything beyond the maximum is not drift (e.g., a route change) */
+#define JANUS_NDI_DRIFT_WINDOW		(10*G_USEC_PER_SEC)
+#define JANUS_NDI_DRIFT_WINDOWS		6
+#define JANUS_NDI_DRIFT_MAX_PPM		1000
+typedef struct janus_ndi_jitter_buffer {
+	janus_ndi_buffer_packet **slots;	/* Packet slots */
+	guint size;							/* Number of slots (always a power of 2) */
+	guint max_size;						/* How many slots we can grow to */
+	gint64 full_warned;					/* When we last warned about the buffer being full */
+	gboolean started;					/* Whether we received any packet yet */
+	uint16_t head_seq;					/* Sequence number of the next packet to play out */
+	uint16_t last_seq;					/* Highest sequence number received so far */
+	gint64 last_inserted;				/* Insert time of the packet with the highest sequence number */
+	gint first;							/* Offset of the first buffered packet from head_seq (-1 if unknown) */
+	volatile guint count;				/* Number of packets currently in the buffer */
+	/* Network conditions, for the adaptive buffer */
+	int clock_rate;						/* RTP clock rate of the stream */
+	gint64 prev_arrival;				/* Arrival time of the previous packet with a different timestamp */
+	uint32_t prev_ts;					/* RTP timestamp of that packet */
+	gint64 last_update;					/* When we last updated the target */
+	double reorder_delay;				/* How late reordered packets arrive, in us (decays over time) */
+	volatile gint jitter;				/* RFC 3550 interarrival jitter, in us */
+	volatile gint target;				/* Buffer size we'd need for this stream, in us */
+	/* Clock drift of the sender, compared to our clock */
+	uint32_t drift_ts;					/* Highest RTP timestamp seen so far */
+	int64_t drift_ext_ts;				/* Same as above, extended to 64 bits */
+	gint64 drift_window;				/* When the current window started (0 if not started) */
+	int64_t drift_min;					/* Smallest transit time in the current window, in us */
+	int64_t drift_mins[JANUS_NDI_DRIFT_WINDOWS];	/* Smallest transit times in the last windows */
+	gint64 drift_times[JANUS_NDI_DRIFT_WINDOWS];	/* When those windows ended */
+	guint drift_windows;				/* How many windows we measured so far */
+	double drift;						/* Estimated drift, in ppm (positive if the sender's clock is faster) */
+	volatile gint drift_ppm;			/* Same as above, rounded, for stats */
+	/* Statistics */
+	volatile guint reordered, duplicates, late, lost, resets;
+} janus_ndi_jitter_buffer;
+static void janus_ndi_jitter_buffer_init(janus_ndi_jitter_buffer *jb, guint size, guint max_size, int clock_rate) {
+	memset(jb, 0, sizeof(*jb));
+	jb->slots = g_malloc0(size * sizeof(janus_ndi_buffer_packet *));
+	jb->size = size;
+	jb->max_size = max_size;
+	jb->first = -1;
+	jb->clock_rate = clock_rate;
+	jb->target = adaptive_buffer ? CLAMP(buffer_size, buffer_min, buffer_max) : buffer_size;
+}
+/* Update the clock drift estimate: if the sender's clock is faster than
+ * ours, media time advances faster than our clock and the transit time
+ * slowly decreases, and viceversa. We only look at the smallest transit
+ * time in each window, which filters out most of the jitter, and measure
+ * the slope over several windows, smoothing the result over time */
+static void janus_ndi_jitter_buffer_drift(janus_ndi_jitter_buffer *jb, janus_ndi_buffer_packet *pkt) {
+	gint64 arrival = pkt->inserted;
+	int32_t diff = (int32_t)(pkt->timestamp - jb->drift_ts);
+	if(jb->drift_window == 0) {
+		/* First packet */
+		diff = 0;
+		jb->drift_ts = pkt->timestamp;
+		jb->drift_ext_ts = 0;
+	} else if(diff > 0) {
+		jb->drift_ts = pkt->timestamp;
+		jb->drift_ext_ts += diff;
+		diff = 0;
+	}
+	int64_t media = (jb->drift_ext_ts + diff) * G_USEC_PER_SEC / jb->clock_rate;
+	int64_t transit = arrival - media;
+	if(jb->drift_window == 0 || transit < jb->drift_min)
+		jb->drift_min = transit;
+	if(jb->drift_window == 0)
+		jb->drift_window = arrival;
+	if(arrival - jb->drift_window < JANUS_NDI_DRIFT_WINDOW)
+		return;
+	/* The window is over, compare to the oldest one we have */
+	guint index = jb->drift_windows % JANUS_NDI_DRIFT_WINDOWS;
+	if(jb->drift_windows >= JANUS_NDI_DRIFT_WINDOWS) {
+		double measured = -(double)(jb->drift_min - jb->drift_mins[index]) * 1000000.0 /
+			(double)(arrival - jb->drift_times[index]);
+		if(fabs(measured) <= JANUS_NDI_DRIFT_MAX_PPM) {
+			if(jb->drift_windows == JANUS_NDI_DRIFT_WINDOWS)
+				jb->drift = measured;
+			else
+				jb->drift += (measured - jb->drift) / 8;
+			g_atomic_int_set(&jb->drift_ppm, (gint)lrint(jb->drift));
+		}
+	}
+	jb->drift_mins[index] = jb->drift_min;
+	jb->drift_times[index] = arrival;
+	jb->drift_windows++;
+	jb->drift_window = arrival;
+	jb->drift_min = transit;
+}
+/* Update the jitter estimate (RFC 3550, section 6.4.1) and the buffer size
+ * we'd need: we grow right away when conditions get worse, but shrink slowly
+ * (1ms per 100ms) to avoid oscillating. Video packets that are part of the
+ * same frame are ignored, since they all have the same timestamp */
+static void janus_ndi_jitter_buffer_estimate(janus_ndi_jitter_buffer *jb, janus_ndi_buffer_packet *pkt) {
+	gint64 arrival = pkt->inserted;
+	if(jb->prev_arrival == 0) {
+		jb->prev_arrival = arrival;
+		jb->prev_ts = pkt->timestamp;
+		jb->last_update = arrival;
+		return;
+	}
+	if(pkt->timestamp == jb->prev_ts)
+		return;
+	gint64 sent = (gint64)((int32_t)(pkt->timestamp - jb->prev_ts)) * G_USEC_PER_SEC / jb->clock_rate;
+	gint64 d = (arrival - jb->prev_arrival) - sent;
+	if(d < 0)
+		d = -d;
+	gint jitter = jb->jitter + (gint)((d - jb->jitter) / 16);
+	g_atomic_int_set(&jb->jitter, jitter);
+	jb->prev_arrival = arrival;
+	jb->prev_ts = pkt->timestamp;
+	jb->reorder_delay -= jb->reorder_delay / 256;
+	janus_ndi_jitter_buffer_drift(jb, pkt);
+	if(!adaptive_buffer)
+		return;
+	gint64 needed = 3*(gint64)jitter + (gint64)jb->reorder_delay;
+	if(needed < buffer_min)
+		needed = buffer_min;
+	if(needed > buffer_max)
+		needed = buffer_max;
+	gint64 target = jb->target;
+	if(needed > target) {
+		target = needed;
+	} else if(needed < target) {
+		gint64 step = (arrival - jb->last_update) / 100;
+		target -= MIN(target - needed, step);
+	}
+	jb->last_update = arrival;
+	g_atomic_int_set(&jb->target, (gint)target);
+}
+static void janus_ndi_jitter_buffer_flush(janus_ndi_jitter_buffer *jb) {
+	guint i = 0;
+	for(i=0; jb->count > 0 && i<jb->size; i++) {
+		if(jb->slots[i] != NULL) {
+			janus_ndi_buffer_packet_destroy(jb->slots[i]);
+			jb->slots[i] = NULL;
+			jb->count--;
+		}
+	}
+	jb->count = 0;
+	jb->started = FALSE;
+	jb->first = -1;
+	/* The timestamps may start from scratch too: keep the drift we
+	 * estimated so far, but start measuring it again */
+	jb->drift_window = 0;
+	jb->drift_windows = 0;
+}
+static void janus_ndi_jitter_buffer_free(janus_ndi_jitter_buffer *jb) {
+	janus_ndi_jitter_buffer_flush(jb);
+	g_free(jb->slots);
+	jb->slots = NULL;
+}
+/* Returns TRUE if the packet was added to the buffer, FALSE if it must be
+ * dropped (duplicate, or too late to be played out) */
+static gboolean janus_ndi_jitter_buffer_insert(janus_ndi_jitter_buffer *jb, janus_ndi_buffer_packet *pkt) {
+	if(!jb->started) {
+		jb->started = TRUE;
+		jb->head_seq = pkt->seq_number;
+		jb->last_seq = pkt->seq_number;
+		jb->last_inserted = pkt->inserted;
+	}
+	janus_ndi_jitter_buffer_estimate(jb, pkt);
+	int16_t diff = (int16_t)(pkt->seq_number - jb->head_seq);
+	if(diff < 0 && diff > -(int)jb->size) {
+		/* We already played out (or gave up on) this sequence number */
+		g_atomic_int_inc(&jb->late);
+		return FALSE;
+	}
+	if(diff >= (int)jb->size && diff < (int)jb->max_size && jb->count >= jb->size/2) {
+		/* We're buffering more packets than we have slots for: double the
+		 * slots until this packet fits (the buffered packets all fit in a
+		 * window of the old size, so they can't collide in the new one) */
+		while(diff >= (int)jb->size) {
+			guint size = jb->size*2, i = 0;
+			janus_ndi_buffer_packet **slots = g_malloc0(size * sizeof(janus_ndi_buffer_packet *));
+			for(i=0; i<jb->size; i++) {
+				if(jb->slots[i] != NULL)
+					slots[jb->slots[i]->seq_number & (size - 1)] = jb->slots[i];
+			}
+			g_free(jb->slots);
+			jb->slots = slots;
+			jb->size = size;
+		}
+	}
+	if(diff < 0 || diff >= (int)jb->size) {
+		/* Way off what we're buffering (stream restart?), start from scratch */
+		if(diff > 0 && jb->count >= jb->size/2 && pkt->inserted - jb->full_warned >= 10*G_USEC_PER_SEC) {
+			/* Actually, the buffer is full and can't grow anymore */
+			JANUS_LOG(LOG_WARN, "Jitter buffer full (%u packets), resetting it: is the buffer too long for this stream?\n",
+				jb->count);
+			jb->full_warned = pkt->inserted;
+		}
+		janus_ndi_jitter_buffer_flush(jb);
+		g_atomic_int_inc(&jb->resets);
+		return janus_ndi_jitter_buffer_insert(jb, pkt);
+	}
+	janus_ndi_buffer_packet **slot = &jb->slots[pkt->seq_number & (jb->size - 1)];
+	if(*slot != NULL) {
+		/* Duplicate (e.g., retransmission of a packet we already got) */
+		g_atomic_int_inc(&jb->duplicates);
+		return FALSE;
+	}
+	if((int16_t)(pkt->seq_number - jb->last_seq) > 0) {
+		/* In order */
+		jb->last_seq = pkt->seq_number;
+		jb->last_inserted = pkt->inserted;
+	} else if(pkt->seq_number != jb->last_seq) {
+		/* Out of order: use the insert time of a neighbour, or of the most
+		 * recent packet, so that this packet doesn't delay the next ones */
+		g_atomic_int_inc(&jb->reordered);
+		janus_ndi_buffer_packet *next = jb->slots[(uint16_t)(pkt->seq_number+1) & (jb->size - 1)];
+		if(next != NULL && next->seq_number == (uint16_t)(pkt->seq_number+1) && pkt->inserted > next->inserted) {
+			/* Keep track of how late this packet is, compared to the one that followed */
+			double late = (double)(pkt->inserted - next->inserted);
+			if(late > jb->reorder_delay)
+				jb->reorder_delay = late;
+		}
+		janus_ndi_buffer_packet *prev = jb->slots[(uint16_t)(pkt->seq_number-1) & (jb->size - 1)];
+		if(prev == NULL || prev->seq_number != (uint16_t)(pkt->seq_number-1))
+			prev = next;
+		gint64 inserted = (prev != NULL ? prev->inserted : jb->last_inserted);
+		if(inserted < pkt->inserted)
+			pkt->inserted = inserted;
+	}
+	*slot = pkt;
+	jb->count++;
+	if(jb->first != -1 && diff < jb->first)
+		jb->first = diff;
+	return TRUE;
+}
+/* Returns the next packet to play out, if any, and how many sequence numbers are missing before it */
+static janus_ndi_buffer_packet *janus_ndi_jitter_buffer_peek(janus_ndi_jitter_buffer *jb, uint16_t *missing) {
+	if(jb->count == 0)
+		return NULL;
+	if(jb->first == -1) {
+		jb->first = 0;
+		while(jb->slots[(uint16_t)(jb->head_seq + jb->first) & (jb->size - 1)] == NULL)
+			jb->first++;
+	}
+	if(missing)
+		*missing = jb->first;
+	return jb->slots[(uint16_t)(jb->head_seq + jb->first) & (jb->size - 1)];
+}
+static janus_ndi_buffer_packet *janus_ndi_jitter_buffer_pop(janus_ndi_jitter_buffer *jb, uint16_t *missing) {
+	uint16_t skipped = 0;
+	janus_ndi_buffer_packet *pkt = janus_ndi_jitter_buffer_peek(jb, &skipped);
+	if(pkt == NULL)
+		return NULL;
+	jb->slots[pkt->seq_number & (jb->size - 1)] = NULL;
+	jb->count--;
+	if(skipped > 0)
+		g_atomic_int_add(&jb->lost, skipped);
+	jb->head_seq = pkt->seq_number + 1;
+	jb->first = -1;
+	if(missing)
+		*missing = skipped;
+	return pkt;
+}
+
+/* Lock-free single-producer/single-consumer ring of buffered packets: the
+ * Janus core RTP thread is the only producer, and the session task is the
+ * only consumer, so that the RTP path never has to wait on a session that's
+ * busy decoding or sending via NDI. Head and tail are free-running counters */
+#define JANUS_NDI_AUDIO_RING_SIZE	256
+#define JANUS_NDI_VIDEO_RING_SIZE	1024
+typedef struct janus_ndi_ring {
+	janus_ndi_buffer_packet **slots;	/* Packet slots */
+	guint size;							/* Number of slots (always a power of 2) */
+	volatile guint head;				/* Next slot to read (only updated by the consumer) */
+	volatile guint tail;				/* Next slot to write (only updated by the producer) */
+	volatile guint max_depth;			/* Highest number of packets we ever had in the ring */
+	volatile guint overflows;			/* Number of packets dropped because the ring was full */
+} janus_ndi_ring;
+static void janus_ndi_ring_init(janus_ndi_ring *ring, guint size) {
+	ring->slots = g_malloc0(size * sizeof(janus_ndi_buffer_packet *));
+	ring->size = size;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->max_depth = 0;
+	ring->overflows = 0;
+}
+static guint janus_ndi_ring_depth(janus_ndi_ring *ring) {
+	return (guint)g_atomic_int_get(&ring->tail) - (guint)g_atomic_int_get(&ring->head);
+}
+/* Producer side: returns the ring depth after the push, or 0 if the ring was full */
+static guint janus_ndi_ring_push(janus_ndi_ring *ring, janus_ndi_buffer_packet *pkt) {
+	guint tail = ring->tail;
+	guint depth = tail - (guint)g_atomic_int_get(&ring->head);
+	if(depth >= ring->size) {
+		g_atomic_int_inc(&ring->overflows);
+		return 0;
+	}
+	ring->slots[tail & (ring->size - 1)] = pkt;
+	g_atomic_int_set(&ring->tail, tail + 1);
+	depth++;
+	if(depth > ring->max_depth)
+		g_atomic_int_set(&ring->max_depth, depth);
+	return depth;
+}
+/* Consumer side */
+static janus_ndi_buffer_packet *janus_ndi_ring_peek(janus_ndi_ring *ring) {
+	guint head = ring->head;
+	if(head == (guint)g_atomic_int_get(&ring->tail))
+		return NULL;
+	return ring->slots[head & (ring->size - 1)];
+}
+static janus_ndi_buffer_packet *janus_ndi_ring_pop(janus_ndi_ring *ring) {
+	guint head = ring->head;
+	if(head == (guint)g_atomic_int_get(&ring->tail))
+		return NULL;
+	janus_ndi_buffer_packet *pkt = ring->slots[head & (ring->size - 1)];
+	g_atomic_int_set(&ring->head, head + 1);
+	return pkt;
+}
+/* Pool of buffered packets: slots are handed out by the Janus core RTP thread,
+ * and given back by the audio or video session task when it's done with
+ * them, using a ring that goes in the opposite direction of the one used for
+ * incoming packets (which is why audio and video have a pool each) */
+#define JANUS_NDI_AUDIO_POOL_SIZE	256
+#define JANUS_NDI_VIDEO_POOL_SIZE	1024
+typedef struct janus_ndi_packet_pool {
+	janus_ndi_buffer_packet *slab;		/* All the packets in the pool */
+	guint size;							/* Number of packets in the pool */
+	janus_ndi_ring free;				/* Recycled packets (producer: session task, consumer: RTP thread) */
+	janus_ndi_buffer_packet *spare;		/* Packet the RTP thread couldn't use (only accessed by the RTP thread) */
+	volatile guint misses;				/* Number of packets we had to allocate on the heap */
+} janus_ndi_packet_pool;
+static void janus_ndi_packet_pool_init(janus_ndi_packet_pool *pool, guint size) {
+	pool->slab = g_malloc(size * sizeof(janus_ndi_buffer_packet));
+	pool->size = size;
+	janus_ndi_ring_init(&pool->free, size);
+	guint i = 0;
+	for(i=0; i<size; i++) {
+		pool->slab[i].pool = pool;
+		janus_ndi_ring_push(&pool->free, &pool->slab[i]);
+	}
+	pool->free.max_depth = 0;
+	pool->spare = NULL;
+	pool->misses = 0;
+}
+/* Only safe when all the packets have been given back to the pool */
+static void janus_ndi_packet_pool_free(janus_ndi_packet_pool *pool) {
+	if(pool->slab == NULL)
+		return;
+	g_free(pool->free.slots);
+	pool->free.slots = NULL;
+	g_free(pool->slab);
+	pool->slab = NULL;
+}
+/* Only invoked by the RTP thread: the packet is parsed right away, so that
+ * the session task doesn't need to parse the RTP header again later */
+static janus_ndi_buffer_packet *janus_ndi_buffer_packet_create(janus_ndi_packet_pool *pool,
+		char *buffer, int len, char *payload, int plen) {
+	janus_ndi_buffer_packet *pkt = NULL;
+	if(pool->slab != NULL && len <= JANUS_NDI_PACKET_SLOT_SIZE) {
+		pkt = pool->spare;
+		pool->spare = NULL;
+		if(pkt == NULL)
+			pkt = janus_ndi_ring_pop(&pool->free);
+	}
+	if(pkt != NULL) {
+		pkt->buffer = pkt->data;
+	} else {
+		/* Oversized packet, or no slot available */
+		g_atomic_int_inc(&pool->misses);
+		pkt = g_malloc(sizeof(janus_ndi_buffer_packet) - JANUS_NDI_PACKET_SLOT_SIZE + len);
+		pkt->pool = NULL;
+		pkt->buffer = pkt->data;
+	}
 	pkt->len = len;
 	memcpy(pkt->buffer, buffer, len);
+	pkt->payload = payload - buffer;
+	pkt->plen = plen;
 	janus_rtp_header *rtp = (janus_rtp_header *)buffer;
+	pkt->marker = rtp->markerbit;
 	pkt->timestamp = ntohl(rtp->timestamp);
 	pkt->seq_number = ntohs(rtp->seq_number);
 	pkt->inserted = g_get_monotonic_time();
 	return pkt;
 }
+/* Only invoked by the RTP thread, for packets it couldn't queue */
+static void janus_ndi_buffer_packet_discard(janus_ndi_buffer_packet *pkt) {
+	if(pkt->pool == NULL) {
+		g_free(pkt);
+		return;
+	}
+	pkt->pool->spare = pkt;
+}
+/* Only invoked by the audio or video session task, or when the session is being freed */
 static void janus_ndi_buffer_packet_destroy(janus_ndi_buffer_packet *pkt) {
 	if(!pkt)
 		return;
-	g_free(pkt->buffer);
-	g_free(pkt);
-}
-static gint janus_ndi_buffer_packet_compare(gconstpointer a, gconstpointer b, gpointer user_data) {
-	janus_ndi_buffer_packet *bpa = (janus_ndi_buffer_packet *)a;
-	janus_ndi_buffer_packet *bpb = (janus_ndi_buffer_packet *)b;
-	if(bpa->timestamp == bpb->timestamp) {
-		/* Check the sequence numbers */
-		if(bpa->seq_number == bpb->seq_number) {
-			/* Same packet? */
-			return 0;
-		} else if(bpa->seq_number < bpb->seq_number) {
-			if(bpb->seq_number - bpa->seq_number < 30000) {
-				/* Sequence number wrapped */
-				return -1;
-			} else {
-				/* Regular ordering */
-				return 1;
-			}
-		} else if(bpa->seq_number > bpb->seq_number) {
-			if(bpa->seq_number - bpb->seq_number < 30000) {
-				/* Sequence number wrapped */
-				return 1;
-			} else {
-				/* Regular ordering */
-				return -1;
-			}
+	if(pkt->pool == NULL) {
+		g_free(pkt);
+		return;
+	}
+	/* The free ring is as large as the pool, so this can't fail */
+	janus_ndi_ring_push(&pkt->pool->free, pkt);
+}
+/* Only safe when neither the producer nor the consumer are active */
+static void janus_ndi_ring_free(janus_ndi_ring *ring) {
+	janus_ndi_buffer_packet *pkt = NULL;
+	while((pkt = janus_ndi_ring_pop(ring)) != NULL)
+		janus_ndi_buffer_packet_destroy(pkt);
+	g_free(ring->slots);
+	ring->slots = NULL;
+}
+
+/* Shared pool of media workers: sessions and placeholders are tasks that
+ * the workers run when they're kicked (e.g., because a packet arrived) or
+ * when a timer they asked for expires, so that the number of threads doesn't
+ * grow with the number of NDI senders. Each task has a home worker it's
+ * queued to when kicked, but idle workers can steal ready tasks from busy ones.
+ * Timers are shared instead: one of the idle workers waits for the next one
+ * to expire on behalf of all of them, so that a worker busy with a long run
+ * can't delay the tasks waiting for a timer (e.g., the audio playout) */
+typedef struct janus_ndi_task janus_ndi_task;
+/* Callback to run a task: returns the monotonic time the task should run
+ * again at (0 to only run it when kicked, -1 if the task is done) */
+typedef gint64 (*janus_ndi_task_run_cb)(janus_ndi_task *task);
+/* Callback invoked when a task is done (the task won't be touched after that) */
+typedef void (*janus_ndi_task_done_cb)(janus_ndi_task *task);
+typedef enum janus_ndi_task_state {
+	JANUS_NDI_TASK_IDLE = 0,
+	JANUS_NDI_TASK_QUEUED,
+	JANUS_NDI_TASK_RUNNING,
+	JANUS_NDI_TASK_DONE
+} janus_ndi_task_state;
+struct janus_ndi_worker;
+struct janus_ndi_task {
+	janus_ndi_task_run_cb run;				/* Callback to run the task */
+	janus_ndi_task_done_cb done;			/* Callback to invoke when the task is done, if any */
+	void *data;								/* Opaque pointer to pass to the callbacks */
+	volatile gint state;					/* Current state of the task (janus_ndi_task_state) */
+	volatile gint rerun;					/* Whether the task was kicked while running */
+	struct janus_ndi_worker *home;			/* Worker the task is queued to when kicked */
+	volatile gint timer_pending;			/* Whether the task has a timer pending */
+	guint timer_index;						/* Position of the timer in the heap */
+	gint64 deadline;						/* When the timer expires */
+};
+typedef struct janus_ndi_worker {
+	guint id;								/* Index of the worker */
+	GThread *thread;						/* Worker thread */
+	GQueue ready;							/* Tasks ready to run */
+	volatile gint queued;					/* Length of the above, for other workers to check without locking */
+	volatile gint sleeping;					/* Whether the worker is waiting for something to do */
+	volatile guint runs, steals;			/* How many tasks this worker ran, and how many of them it stole */
+	janus_mutex mutex;
+	janus_condition cond;
+} janus_ndi_worker;
+static janus_ndi_worker *workers = NULL;
+static guint workers_num = 0;
+static volatile gint workers_next = 0, workers_stopping = 0;
+/* Min-heap of tasks waiting for a timer, and the worker waiting for the
+ * first one to expire (-1 if none is, which means they're all busy) */
+static GPtrArray *workers_timers = NULL;
+static janus_mutex workers_timers_mutex = JANUS_MUTEX_INITIALIZER;
+static volatile gint workers_timer_waiter = -1;
+/* Tasks that aren't done yet, so that we can wait for them when stopping */
+static GHashTable *workers_tasks = NULL;
+static janus_mutex workers_tasks_mutex = JANUS_MUTEX_INITIALIZER;
+static janus_condition workers_tasks_cond;
+/* How long we wait for tasks to wrap up when stopping */
+#define JANUS_NDI_WORKERS_STOP_TIMEOUT	(5*G_USEC_PER_SEC)
+
+/* Timers heap management (timers mutex must be locked) */
+static void janus_ndi_workers_timer_swap(guint a, guint b) {
+	janus_ndi_task *ta = g_ptr_array_index(workers_timers, a);
+	janus_ndi_task *tb = g_ptr_array_index(workers_timers, b);
+	g_ptr_array_index(workers_timers, a) = tb;
+	g_ptr_array_index(workers_timers, b) = ta;
+	ta->timer_index = b;
+	tb->timer_index = a;
+}
+static void janus_ndi_workers_timer_sift(guint index) {
+	/* Move up, if needed */
+	while(index > 0) {
+		guint parent = (index-1)/2;
+		janus_ndi_task *t = g_ptr_array_index(workers_timers, index);
+		janus_ndi_task *p = g_ptr_array_index(workers_timers, parent);
+		if(p->deadline <= t->deadline)
+			break;
+		janus_ndi_workers_timer_swap(index, parent);
+		index = parent;
+	}
+	/* Move down, if needed */
+	while(TRUE) {
+		guint left = 2*index+1, right = left+1, smallest = index;
+		if(left < workers_timers->len && ((janus_ndi_task *)g_ptr_array_index(workers_timers, left))->deadline <
+				((janus_ndi_task *)g_ptr_array_index(workers_timers, smallest))->deadline)
+			smallest = left;
+		if(right < workers_timers->len && ((janus_ndi_task *)g_ptr_array_index(workers_timers, right))->deadline <
+				((janus_ndi_task *)g_ptr_array_index(workers_timers, smallest))->deadline)
+			smallest = right;
+		if(smallest == index)
+			break;
+		janus_ndi_workers_timer_swap(index, smallest);
+		index = smallest;
+	}
+}
+static void janus_ndi_workers_timer_insert(janus_ndi_task *task, gint64 deadline) {
+	task->deadline = deadline;
+	task->timer_index = workers_timers->len;
+	g_ptr_array_add(workers_timers, task);
+	g_atomic_int_set(&task->timer_pending, 1);
+	janus_ndi_workers_timer_sift(task->timer_index);
+}
+static void janus_ndi_workers_timer_remove(janus_ndi_task *task) {
+	guint index = task->timer_index, last = workers_timers->len-1;
+	if(index != last)
+		janus_ndi_workers_timer_swap(index, last);
+	g_ptr_array_remove_index(workers_timers, last);
+	g_atomic_int_set(&task->timer_pending, 0);
+	if(index != last)
+		janus_ndi_workers_timer_sift(index);
+}
+
+/* Helper to wake up the worker waiting for timers, or an idle one that
+ * will take that role if none is (the worker to skip is the caller, if any) */
+static void janus_ndi_workers_wake_timer_waiter(janus_ndi_worker *skip) {
+	gint id = g_atomic_int_get(&workers_timer_waiter);
+	guint i = 0;
+	for(i=0; i<workers_num; i++) {
+		janus_ndi_worker *idle = &workers[id >= 0 ? ((guint)id + i) % workers_num : i];
+		if(idle == skip || !g_atomic_int_get(&idle->sleeping))
+			continue;
+		janus_mutex_lock(&idle->mutex);
+		janus_condition_signal(&idle->cond);
+		janus_mutex_unlock(&idle->mutex);
+		break;
+	}
+}
+/* Set a timer for a task, waking up whoever needs to know if it's the first to expire */
+static void janus_ndi_workers_timer_add(janus_ndi_task *task, gint64 deadline) {
+	janus_mutex_lock(&workers_timers_mutex);
+	janus_ndi_workers_timer_insert(task, deadline);
+	gboolean first = (task->timer_index == 0);
+	janus_mutex_unlock(&workers_timers_mutex);
+	if(first)
+		janus_ndi_workers_wake_timer_waiter(NULL);
+}
+/* Move the tasks whose timer expired to the ready queue of a worker */
+static void janus_ndi_workers_timers_fire(janus_ndi_worker *worker) {
+	GQueue expired = G_QUEUE_INIT;
+	gint64 now = g_get_monotonic_time();
+	janus_mutex_lock(&workers_timers_mutex);
+	while(workers_timers->len > 0) {
+		janus_ndi_task *task = g_ptr_array_index(workers_timers, 0);
+		if(task->deadline > now)
+			break;
+		janus_ndi_workers_timer_remove(task);
+		if(g_atomic_int_compare_and_exchange(&task->state, JANUS_NDI_TASK_IDLE, JANUS_NDI_TASK_QUEUED)) {
+			g_queue_push_tail(&expired, task);
+			continue;
 		}
-	} else if(bpa->timestamp < bpb->timestamp) {
-		if(bpb->timestamp - bpa->timestamp < 2*1000*1000*1000) {
-			/* Timestamp wrapped */
-			return -1;
+		/* The task is still running the run that set the timer: do what a
+		 * kick would, so that it runs again as soon as it's done */
+		g_atomic_int_set(&task->rerun, 1);
+		if(g_atomic_int_compare_and_exchange(&task->state, JANUS_NDI_TASK_IDLE, JANUS_NDI_TASK_QUEUED))
+			g_queue_push_tail(&expired, task);
+	}
+	janus_mutex_unlock(&workers_timers_mutex);
+	if(g_queue_is_empty(&expired))
+		return;
+	janus_mutex_lock(&worker->mutex);
+	janus_ndi_task *task = NULL;
+	while((task = g_queue_pop_head(&expired)) != NULL) {
+		g_queue_push_tail(&worker->ready, task);
+		g_atomic_int_inc(&worker->queued);
+	}
+	janus_mutex_unlock(&worker->mutex);
+}
+
+/* Helper to queue a task on a worker, waking up an idle worker if needed */
+static void janus_ndi_worker_enqueue(janus_ndi_worker *worker, janus_ndi_task *task) {
+	janus_mutex_lock(&worker->mutex);
+	g_queue_push_tail(&worker->ready, task);
+	g_atomic_int_inc(&worker->queued);
+	gboolean sleeping = g_atomic_int_get(&worker->sleeping);
+	if(sleeping)
+		janus_condition_signal(&worker->cond);
+	janus_mutex_unlock(&worker->mutex);
+	if(sleeping)
+		return;
+	/* The worker is busy, wake up another one (if any is idle) so that it can steal the task */
+	guint i = 0;
+	for(i=1; i<workers_num; i++) {
+		janus_ndi_worker *idle = &workers[(worker->id + i) % workers_num];
+		if(!g_atomic_int_get(&idle->sleeping))
+			continue;
+		janus_mutex_lock(&idle->mutex);
+		janus_condition_signal(&idle->cond);
+		janus_mutex_unlock(&idle->mutex);
+		break;
+	}
+}
+
+/* Prepare a task and assign it a home worker */
+static void janus_ndi_task_init(janus_ndi_task *task, janus_ndi_task_run_cb run, janus_ndi_task_done_cb done, void *data) {
+	task->run = run;
+	task->done = done;
+	task->data = data;
+	task->state = JANUS_NDI_TASK_IDLE;
+	task->rerun = 0;
+	task->home = &workers[(guint)g_atomic_int_add(&workers_next, 1) % workers_num];
+	task->timer_pending = 0;
+	task->timer_index = 0;
+	task->deadline = 0;
+	janus_mutex_lock(&workers_tasks_mutex);
+	g_hash_table_add(workers_tasks, task);
+	janus_mutex_unlock(&workers_tasks_mutex);
+}
+/* Ask for a task to be run as soon as possible: if it's already running,
+ * it will be run again once it's done, so kicks are never lost */
+static void janus_ndi_task_kick(janus_ndi_task *task) {
+	if(g_atomic_int_compare_and_exchange(&task->state, JANUS_NDI_TASK_IDLE, JANUS_NDI_TASK_QUEUED)) {
+		janus_ndi_worker_enqueue(task->home, task);
+		return;
+	}
+	g_atomic_int_set(&task->rerun, 1);
+	/* The task may have become idle in the meanwhile */
+	if(g_atomic_int_compare_and_exchange(&task->state, JANUS_NDI_TASK_IDLE, JANUS_NDI_TASK_QUEUED))
+		janus_ndi_worker_enqueue(task->home, task);
+}
+
+/* Helper to steal a ready task from another worker */
+static janus_ndi_task *janus_ndi_worker_steal(janus_ndi_worker *thief) {
+	janus_ndi_task *task = NULL;
+	guint i = 0;
+	for(i=1; i<workers_num && task == NULL; i++) {
+		janus_ndi_worker *worker = &workers[(thief->id + i) % workers_num];
+		if(g_atomic_int_get(&worker->queued) == 0)
+			continue;
+		janus_mutex_lock(&worker->mutex);
+		task = g_queue_pop_tail(&worker->ready);
+		if(task != NULL)
+			g_atomic_int_add(&worker->queued, -1);
+		janus_mutex_unlock(&worker->mutex);
+	}
+	if(task != NULL)
+		g_atomic_int_inc(&thief->steals);
+	return task;
+}
+
+/* Helper to run a task on a worker */
+static void janus_ndi_worker_run(janus_ndi_worker *worker, janus_ndi_task *task) {
+	g_atomic_int_set(&task->state, JANUS_NDI_TASK_RUNNING);
+	g_atomic_int_set(&task->rerun, 0);
+	/* If the task had a timer pending, get rid of it */
+	if(g_atomic_int_get(&task->timer_pending)) {
+		janus_mutex_lock(&workers_timers_mutex);
+		if(task->timer_pending)
+			janus_ndi_workers_timer_remove(task);
+		janus_mutex_unlock(&workers_timers_mutex);
+	}
+	g_atomic_int_inc(&worker->runs);
+	gint64 next = task->run(task);
+	if(next < 0) {
+		/* The task is done (we stop tracking it before invoking the
+		 * callback, since that may free the memory the task lives in) */
+		g_atomic_int_set(&task->state, JANUS_NDI_TASK_DONE);
+		janus_mutex_lock(&workers_tasks_mutex);
+		g_hash_table_remove(workers_tasks, task);
+		if(g_hash_table_size(workers_tasks) == 0)
+			janus_condition_broadcast(&workers_tasks_cond);
+		janus_mutex_unlock(&workers_tasks_mutex);
+		/* Make sure no other worker is still handling a timer it had */
+		janus_mutex_lock(&workers_timers_mutex);
+		janus_mutex_unlock(&workers_timers_mutex);
+		if(task->done)
+			task->done(task);
+		return;
+	}
+	gboolean again = FALSE;
+	if(next > 0) {
+		if(next <= g_get_monotonic_time()) {
+			/* Already due */
+			again = TRUE;
 		} else {
-			/* Regular ordering */
-			return 1;
+			/* Set a timer (we do that before the task becomes idle: if it
+			 * expires in the meanwhile, the task will be marked to run again) */
+			janus_ndi_workers_timer_add(task, next);
 		}
-	} else if(bpa->timestamp > bpb->timestamp) {
-		if(bpa->timestamp - bpb->timestamp < 2*1000*1000*1000) {
-			/* Timestamp wrapped */
-			return 1;
-		} else {
-			/* Regular ordering */
+	}
+	if(again || g_atomic_int_compare_and_exchange(&task->rerun, 1, 0)) {
+		/* Queue the task again (at the end, to be fair with other tasks) */
+		g_atomic_int_set(&task->state, JANUS_NDI_TASK_QUEUED);
+		janus_mutex_lock(&worker->mutex);
+		g_queue_push_tail(&worker->ready, task);
+		g_atomic_int_inc(&worker->queued);
+		janus_mutex_unlock(&worker->mutex);
+		return;
+	}
+	g_atomic_int_set(&task->state, JANUS_NDI_TASK_IDLE);
+	/* Check if we were kicked right before becoming idle */
+	if(g_atomic_int_get(&task->rerun) &&
+			g_atomic_int_compare_and_exchange(&task->state, JANUS_NDI_TASK_IDLE, JANUS_NDI_TASK_QUEUED)) {
+		janus_mutex_lock(&worker->mutex);
+		g_queue_push_tail(&worker->ready, task);
+		g_atomic_int_inc(&worker->queued);
+		janus_mutex_unlock(&worker->mutex);
+	}
+}
+
+/* Worker thread */
+static void *janus_ndi_worker_thread(void *data) {
+	janus_ndi_worker *worker = (janus_ndi_worker *)data;
+	JANUS_LOG(LOG_VERB, "Starting NDI worker #%u\n", worker->id);
+	janus_ndi_task *task = NULL;
+	while(!g_atomic_int_get(&workers_stopping)) {
+		/* Check if any timer expired: we'll run those tasks ourselves */
+		janus_ndi_workers_timers_fire(worker);
+		janus_mutex_lock(&worker->mutex);
+		task = g_queue_pop_head(&worker->ready);
+		if(task != NULL)
+			g_atomic_int_add(&worker->queued, -1);
+		janus_mutex_unlock(&worker->mutex);
+		if(task == NULL)
+			task = janus_ndi_worker_steal(worker);
+		if(task != NULL) {
+			janus_ndi_worker_run(worker, task);
+			continue;
+		}
+		/* Nothing to do: sleep until a task is queued, and if no other idle
+		 * worker is waiting for the next timer to expire, wait for that too */
+		janus_mutex_lock(&worker->mutex);
+		if(g_queue_is_empty(&worker->ready) && !g_atomic_int_get(&workers_stopping)) {
+			g_atomic_int_set(&worker->sleeping, 1);
+			gint64 deadline = 0;
+			if(g_atomic_int_compare_and_exchange(&workers_timer_waiter, -1, (gint)worker->id)) {
+				janus_mutex_lock(&workers_timers_mutex);
+				if(workers_timers->len > 0)
+					deadline = ((janus_ndi_task *)g_ptr_array_index(workers_timers, 0))->deadline;
+				janus_mutex_unlock(&workers_timers_mutex);
+			}
+			if(deadline > 0)
+				janus_condition_wait_until(&worker->cond, &worker->mutex, deadline);
+			else
+				janus_condition_wait(&worker->cond, &worker->mutex);
+			g_atomic_int_set(&worker->sleeping, 0);
+		}
+		janus_mutex_unlock(&worker->mutex);
+		if(g_atomic_int_compare_and_exchange(&workers_timer_waiter, (gint)worker->id, -1)) {
+			/* We may get busy: take the tasks whose timer expired, and if
+			 * there are more timers pending, have another idle worker wait
+			 * for them in our place */
+			janus_ndi_workers_timers_fire(worker);
+			janus_mutex_lock(&workers_timers_mutex);
+			gboolean pending = (workers_timers->len > 0);
+			janus_mutex_unlock(&workers_timers_mutex);
+			if(pending)
+				janus_ndi_workers_wake_timer_waiter(worker);
+		}
+	}
+	JANUS_LOG(LOG_VERB, "Leaving NDI worker #%u\n", worker->id);
+	return NULL;
+}
+static int janus_ndi_workers_start(guint num) {
+	g_atomic_int_set(&workers_stopping, 0);
+	workers_num = num;
+	workers = g_malloc0(num * sizeof(janus_ndi_worker));
+	workers_tasks = g_hash_table_new(NULL, NULL);
+	janus_condition_init(&workers_tasks_cond);
+	workers_timers = g_ptr_array_new();
+	g_atomic_int_set(&workers_timer_waiter, -1);
+	guint i = 0;
+	for(i=0; i<num; i++) {
+		janus_ndi_worker *worker = &workers[i];
+		worker->id = i;
+		g_queue_init(&worker->ready);
+		janus_mutex_init(&worker->mutex);
+		janus_condition_init(&worker->cond);
+	}
+	for(i=0; i<num; i++) {
+		janus_ndi_worker *worker = &workers[i];
+		GError *error = NULL;
+		char tname[16];
+		g_snprintf(tname, sizeof(tname), "ndi worker %u", i);
+		worker->thread = g_thread_try_new(tname, janus_ndi_worker_thread, worker, &error);
+		if(error != NULL) {
+			JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch NDI worker #%u...\n",
+				error->code, error->message ? error->message : "??", i);
+			g_error_free(error);
 			return -1;
 		}
 	}
+	JANUS_LOG(LOG_INFO, "Started %u NDI workers\n", num);
 	return 0;
 }
+static void janus_ndi_workers_stop(void) {
+	if(workers == NULL)
+		return;
+	/* Kick all the tasks that aren't done yet: they'll notice the plugin is
+	 * stopping and wrap up (e.g., releasing their NDI senders), which we
+	 * wait for before stopping the workers that run them */
+	janus_mutex_lock(&workers_tasks_mutex);
+	GHashTableIter iter;
+	gpointer value = NULL;
+	g_hash_table_iter_init(&iter, workers_tasks);
+	while(g_hash_table_iter_next(&iter, &value, NULL))
+		janus_ndi_task_kick((janus_ndi_task *)value);
+	gint64 deadline = g_get_monotonic_time() + JANUS_NDI_WORKERS_STOP_TIMEOUT;
+	while(g_hash_table_size(workers_tasks) > 0) {
+		if(!janus_condition_wait_until(&workers_tasks_cond, &workers_tasks_mutex, deadline)) {
+			JANUS_LOG(LOG_WARN, "%u NDI tasks didn't wrap up in time\n", g_hash_table_size(workers_tasks));
+			break;
+		}
+	}
+	janus_mutex_unlock(&workers_tasks_mutex);
+	g_atomic_int_set(&workers_stopping, 1);
+	guint i = 0;
+	for(i=0; i<workers_num; i++) {
+		janus_ndi_worker *worker = &workers[i];
+		janus_mutex_lock(&worker->mutex);
+		janus_condition_signal(&worker->cond);
+		janus_mutex_unlock(&worker->mutex);
+	}
+	for(i=0; i<workers_num; i++) {
+		janus_ndi_worker *worker = &workers[i];
+		if(worker->thread != NULL)
+			g_thread_join(worker->thread);
+		g_queue_clear(&worker->ready);
+		janus_mutex_destroy(&worker->mutex);
+		janus_condition_destroy(&worker->cond);
+	}
+	g_free(workers);
+	workers = NULL;
+	workers_num = 0;
+	g_hash_table_destroy(workers_tasks);
+	workers_tasks = NULL;
+	g_ptr_array_free(workers_timers, TRUE);
+	workers_timers = NULL;
+	janus_condition_destroy(&workers_tasks_cond);
+}
 
 /* Message from the core to the plugin, to process asynchronously */
 typedef struct janus_ndi_message {
@@ -262,8 +1199,10 @@ typedef struct janus_ndi_sender {
 	NDIlib_send_instance_t instance;		/* NDI audio/video sender */
 	gboolean placeholder;					/* Whether this sender will be shared or is owned */
 	AVFrame *image;							/* Placeholder image to use, if required */
-	/* Placeholder thread, if required */
-	GThread *thread;
+	/* Placeholder task, if required */
+	janus_ndi_task task;
+	gboolean scheduled;
+	gint64 next_frame;
 	/* Activity on the sender */
 	gint64 last_updated;
 	gboolean busy;
@@ -302,6 +1241,270 @@ static int janus_ndi_generate_placeholder_image(janus_ndi_sender *sender,
 	const char *path, int width, int height, gboolean keep_ratio,
 	int *error_code, char *error_cause, size_t error_cause_len);
 
+/* Video processing state of a session, preserved across runs of its task */
+#define JANUS_NDI_FRAME_BUFFER_SIZE	256000
+#define JANUS_NDI_OUTPUT_FRAMES		2
+#define JANUS_NDI_SCALER_CACHE		4
+/* Scaler contexts we created, which we keep around in case the resolution
+ * goes back to one we've seen before (e.g., senders adapting to congestion) */
+typedef struct janus_ndi_scaler {
+	int src_width, src_height, dst_width, dst_height;
+	enum AVPixelFormat src_format, dst_format;
+	struct SwsContext *sws;
+	gint64 last_used;
+} janus_ndi_scaler;
+/* What the VP8/VP9 payload descriptors tell us about the frame we're
+ * reassembling, which we use to figure out, after a loss, whether the
+ * frame can still be decoded or it depends on something we lost */
+#define JANUS_NDI_LOST_PICTURES		16
+/* When a frame rate is provided, we measure the frame rate of each temporal
+ * layer (over this many RTP timestamp units) to only decode what we need */
+#define JANUS_NDI_TEMPORAL_LAYERS	8
+#define JANUS_NDI_LAYER_WINDOW		(2*90000)
+typedef struct janus_ndi_frame_info {
+	gboolean parsed;		/* Whether we found a payload descriptor at all */
+	int picid;				/* Picture ID (-1 if not available) */
+	int picid_max;			/* Highest picture ID before wrapping (127 or 32767) */
+	int tl0picidx;			/* Index of the base layer frame (-1 if not available) */
+	int tid;				/* Temporal layer (-1 if not available) */
+	gboolean sync;			/* Whether the frame only depends on the base layer (VP8 Y or VP9 U bit) */
+	gboolean nonref;		/* Whether no other frame depends on this one (VP8 N bit) */
+	int refs[3], nrefs;		/* Pictures this frame depends on, in VP9 flexible mode (-1 if not available) */
+} janus_ndi_frame_info;
+static void janus_ndi_frame_info_reset(janus_ndi_frame_info *finfo) {
+	memset(finfo, 0, sizeof(*finfo));
+	finfo->picid = -1;
+	finfo->tl0picidx = -1;
+	finfo->tid = -1;
+	finfo->nrefs = -1;
+}
+typedef struct janus_ndi_video_state {
+	/* Video decoding stuff */
+	uint8_t *received_frame, *obu_data;
+	int frame_size, obu_size;	/* Allocated sizes, not counting the padding */
+	AVBufferPool *frame_pool;	/* Pool of buffers we reassemble frames in */
+	AVBufferRef *frame_buf;		/* Buffer we're reassembling the current frame in */
+	AVPacket *packet;
+	int frame_len, data_len;
+	gboolean truncated;
+	guint32 prev_ts, last_ts;
+	gboolean prevts_set, ts_changed, got_video, got_keyframe, key_frame;
+	uint8_t gaps;
+	gboolean waiting_kf;
+	/* Decodability of VP8/VP9 frames after a loss */
+	janus_ndi_frame_info finfo;		/* Info on the frame we're reassembling */
+	int last_picid, last_tl0picidx;	/* Picture ID and base layer index of the previous frame */
+	uint8_t broken_layers;			/* Temporal layers we can't decode until they resync */
+	gint64 broken_since;			/* When they broke */
+	int lost_pictures[JANUS_NDI_LOST_PICTURES];	/* Pictures we lost or skipped (VP9 flexible mode) */
+	guint lost_index;
+	/* Temporal layers we decode, when a lower frame rate is enough */
+	int layer_cap;					/* Highest temporal layer we decode */
+	guint layer_frames[JANUS_NDI_TEMPORAL_LAYERS];	/* Frames per layer in the current window */
+	guint32 layer_ts;				/* Timestamp the current window started at */
+	gboolean layer_ts_set;
+	int width, height;
+	AVFrame *frame, *decoded_frame, *scaled_frame, *canvas;
+	/* Frames we convert to: when sending asynchronously, NDI may still be
+	 * compressing the last one we sent, so we rotate among them */
+	AVFrame *output_frames[JANUS_NDI_OUTPUT_FRAMES];
+	uint8_t *output_buffers[JANUS_NDI_OUTPUT_FRAMES];
+	int output_size;	/* Size of the output buffers, which only grow */
+	enum AVPixelFormat input_format, output_format;
+	int output_index;
+	gboolean async_pending;
+	double drift_frames;	/* Fraction of a frame the clock drift accumulated so far */
+	gint64 repeat_at;		/* When to repeat the last frame we sent, to compensate the drift (0 if not needed) */
+	NDIlib_video_frame_v2_t repeat_frame;
+	/* Gaps we're waiting for retransmissions to fill */
+	gint64 frame_interval;	/* Estimated time between frames, in us */
+	guint32 interval_ts;	/* Timestamp of the previous frame, to estimate the above */
+	gboolean interval_ts_set;
+	gboolean holding;		/* Whether we're holding a packet, waiting for the ones before it */
+	uint16_t hold_seq;		/* Sequence number of the packet we're holding */
+	uint16_t hold_missing;	/* How many packets were missing before it when we started */
+	guint hold_lost;		/* Packets the jitter buffer had given up on at that point */
+	/* Current scaler, and the ones we may need again */
+	struct SwsContext *sws, *sws_canvas;
+	janus_ndi_scaler scalers[JANUS_NDI_SCALER_CACHE];
+	/* Keyframe requests: whether we need a keyframe, when we last asked for
+	 * one, when we can ask again, and how long we'll wait the next time */
+	gboolean need_pli;
+	gint64 last_pli, next_pli, pli_backoff;
+	guint pli_attempts;		/* Requests we sent since the last keyframe */
+	int fir_seq;			/* Sequence number of our FIRs */
+	/* Tally monitoring and state */
+	gboolean tally_preview, tally_program;
+	gint64 tally_last_poll;
+	/* When we started wrapping up */
+	gint64 destroyed;
+} janus_ndi_video_state;
+static janus_ndi_video_state *janus_ndi_video_state_create(janus_videocodec vcodec) {
+	janus_ndi_video_state *vs = g_malloc0(sizeof(janus_ndi_video_state));
+	vs->frame_interval = G_USEC_PER_SEC/30;
+	vs->pli_backoff = JANUS_NDI_KEYFRAME_BACKOFF_MIN;
+	janus_ndi_frame_info_reset(&vs->finfo);
+	vs->last_picid = -1;
+	vs->last_tl0picidx = -1;
+	vs->layer_cap = JANUS_NDI_TEMPORAL_LAYERS-1;
+	int i = 0;
+	for(i=0; i<JANUS_NDI_LOST_PICTURES; i++)
+		vs->lost_pictures[i] = -1;
+	vs->frame_size = MIN(JANUS_NDI_FRAME_BUFFER_SIZE, frame_buffer_max);
+	vs->frame_pool = av_buffer_pool_init(vs->frame_size + AV_INPUT_BUFFER_PADDING_SIZE, NULL);
+	vs->packet = av_packet_alloc();
+	if(vcodec == JANUS_VIDEOCODEC_AV1) {
+		vs->obu_size = vs->frame_size;
+		vs->obu_data = g_malloc0(vs->obu_size + AV_INPUT_BUFFER_PADDING_SIZE);
+	}
+	vs->decoded_frame = av_frame_alloc();
+	vs->input_format = AV_PIX_FMT_NONE;
+	vs->output_format = AV_PIX_FMT_NONE;
+	return vs;
+}
+/* Make sure a reassembly buffer can contain the provided amount of data (plus
+ * padding), growing it geometrically if needed, but never beyond the cap */
+static gboolean janus_ndi_video_state_grow(uint8_t **buffer, int *size, int needed) {
+	if(needed <= *size)
+		return TRUE;
+	if(needed > frame_buffer_max)
+		return FALSE;
+	int new_size = MAX(*size, JANUS_NDI_FRAME_BUFFER_SIZE);
+	while(new_size < needed)
+		new_size *= 2;
+	new_size = MIN(new_size, frame_buffer_max);
+	*buffer = g_realloc(*buffer, new_size + AV_INPUT_BUFFER_PADDING_SIZE);
+	*size = new_size;
+	return TRUE;
+}
+/* Same as above, but for the pooled buffer we reassemble frames in: if we
+ * don't have one yet, we get it from the pool, and if we need a larger one
+ * we replace the pool (buffers still in use are freed when released) */
+static gboolean janus_ndi_video_state_grow_frame(janus_ndi_video_state *vs, int needed) {
+	if(needed <= vs->frame_size && vs->frame_buf != NULL)
+		return TRUE;
+	if(needed > vs->frame_size) {
+		if(needed > frame_buffer_max)
+			return FALSE;
+		int new_size = vs->frame_size;
+		while(new_size < needed)
+			new_size *= 2;
+		vs->frame_size = MIN(new_size, frame_buffer_max);
+		av_buffer_pool_uninit(&vs->frame_pool);
+		vs->frame_pool = av_buffer_pool_init(vs->frame_size + AV_INPUT_BUFFER_PADDING_SIZE, NULL);
+	}
+	AVBufferRef *buf = vs->frame_pool ? av_buffer_pool_get(vs->frame_pool) : NULL;
+	if(buf == NULL)
+		return FALSE;
+	if(vs->frame_buf != NULL && vs->frame_len > 0)
+		memcpy(buf->data, vs->frame_buf->data, vs->frame_len);
+	av_buffer_unref(&vs->frame_buf);
+	vs->frame_buf = buf;
+	vs->received_frame = buf->data;
+	return TRUE;
+}
+static void janus_ndi_video_state_free_output(janus_ndi_video_state *vs) {
+	int i = 0;
+	for(i=0; i<JANUS_NDI_OUTPUT_FRAMES; i++) {
+		av_frame_free(&vs->output_frames[i]);
+		av_freep(&vs->output_buffers[i]);
+	}
+	vs->output_size = 0;
+	vs->scaled_frame = NULL;
+	vs->output_index = 0;
+	vs->repeat_at = 0;
+}
+/* Get a scaler from the cache, creating it (and possibly evicting the
+ * least recently used one) if we don't have it yet */
+static struct SwsContext *janus_ndi_video_state_get_scaler(janus_ndi_video_state *vs,
+		int src_width, int src_height, enum AVPixelFormat src_format,
+		int dst_width, int dst_height, enum AVPixelFormat dst_format) {
+	janus_ndi_scaler *scaler = &vs->scalers[0];
+	int i = 0;
+	for(i=0; i<JANUS_NDI_SCALER_CACHE; i++) {
+		janus_ndi_scaler *s = &vs->scalers[i];
+		if(s->sws != NULL && s->src_width == src_width && s->src_height == src_height &&
+				s->src_format == src_format && s->dst_width == dst_width &&
+				s->dst_height == dst_height && s->dst_format == dst_format) {
+			s->last_used = janus_get_monotonic_time();
+			return s->sws;
+		}
+		/* Unused slots have never been used, so they'll be picked first */
+		if(s->last_used < scaler->last_used)
+			scaler = s;
+	}
+	struct SwsContext *sws = sws_getContext(src_width, src_height, src_format,
+		dst_width, dst_height, dst_format, SWS_FAST_BILINEAR, NULL, NULL, NULL);
+	if(sws == NULL)
+		return NULL;
+	if(scaler->sws != NULL)
+		sws_freeContext(scaler->sws);
+	scaler->src_width = src_width;
+	scaler->src_height = src_height;
+	scaler->src_format = src_format;
+	scaler->dst_width = dst_width;
+	scaler->dst_height = dst_height;
+	scaler->dst_format = dst_format;
+	scaler->sws = sws;
+	scaler->last_used = janus_get_monotonic_time();
+	return sws;
+}
+/* Make sure NDI is not reading any of our output frames anymore */
+static void janus_ndi_video_state_flush(janus_ndi_video_state *vs, janus_ndi_sender *sender) {
+	if(!vs->async_pending || sender == NULL)
+		return;
+	janus_mutex_lock(&sender->mutex);
+	NDIlib_send_send_video_async_v2(sender->instance, NULL);
+	janus_mutex_unlock(&sender->mutex);
+	vs->async_pending = FALSE;
+}
+static void janus_ndi_video_state_free(janus_ndi_video_state *vs) {
+	if(vs == NULL)
+		return;
+	av_buffer_unref(&vs->frame_buf);
+	av_buffer_pool_uninit(&vs->frame_pool);
+	av_packet_free(&vs->packet);
+	g_free(vs->obu_data);
+	av_frame_free(&vs->decoded_frame);
+	janus_ndi_video_state_free_output(vs);
+	int i = 0;
+	for(i=0; i<JANUS_NDI_SCALER_CACHE; i++) {
+		if(vs->scalers[i].sws != NULL)
+			sws_freeContext(vs->scalers[i].sws);
+	}
+	if(vs->sws_canvas)
+		sws_freeContext(vs->sws_canvas);
+	if(vs->canvas != NULL) {
+		av_free(vs->canvas->data[0]);
+		av_frame_free(&vs->canvas);
+	}
+	g_free(vs);
+}
+
+/* Largest Opus packet we may need to decode (120ms at 48kHz), per channel */
+#define JANUS_NDI_OPUS_MAX_SAMPLES	5760
+/* Planar samples we may need to hold, per channel, when aggregating audio:
+ * less than a full frame waiting to be sent, plus the packet just decoded,
+ * plus some room for the samples drift compensation may add */
+#define JANUS_NDI_AUDIO_FIFO_SAMPLES	(JANUS_NDI_AUDIO_FRAME_MAX*48 + JANUS_NDI_OPUS_MAX_SAMPLES + 256)
+/* Drift compensation is applied to audio one second at a time */
+#define JANUS_NDI_DRIFT_DISTANCE	48000
+/* Longest gap in the audio we'll conceal, per channel: anything longer than
+ * that (e.g., a stream restart) is left as a gap */
+#define JANUS_NDI_AUDIO_PLC_MAX_SAMPLES	JANUS_NDI_OPUS_MAX_SAMPLES
+
+/* Mapping of the RTP timestamps of a stream to the wallclock of the sender,
+ * as advertised in the last RTCP sender report we received for it */
+typedef struct janus_ndi_clock {
+	gboolean valid;		/* Whether we received a sender report yet */
+	uint32_t rtp_ts;	/* RTP timestamp in the sender report */
+	int64_t wallclock;	/* Matching NTP time, in us since the Unix epoch */
+	int clock_rate;		/* RTP clock rate of the stream */
+	guint reports;		/* Number of sender reports received */
+} janus_ndi_clock;
+/* Seconds between the NTP (1900) and Unix (1970) epochs */
+#define JANUS_NDI_NTP_UNIX_OFFSET	2208988800ULL
+
 /* User session */
 typedef struct janus_ndi_session {
 	janus_plugin_session *handle;
@@ -313,25 +1516,70 @@ typedef struct janus_ndi_session {
 #else
 	janus_rtp_switching_context artpctx, vrtpctx;	/* RTP contexts */
 #endif
-	uint16_t a_max_seq_nr, v_max_seq_nr;	/* Max sequence numbers */
 	uint32_t bitrate;						/* Bitrate to enforce via REMB */
 	/* NDI and audio/video decoders */
 	OpusDecoder *audiodec;					/* Opus decoder */
 	janus_videocodec vcodec;				/* Video codec */
 	AVCodecContext *ctx;					/* Video decoder */
 	gboolean strict_decoder;				/* Whether we should discard frames with missing packets */
+	int decoder_threads, decoder_threading;	/* Threads and threading mode the video decoder ended up using */
+	volatile gint decoded_frames;			/* Number of video frames decoded so far */
+	volatile gint decode_latency;			/* Smoothed time it takes to decode a video frame, in us */
+	volatile gint decode_latency_max;		/* Highest time it took to decode a video frame, in us */
+	volatile gint frame_buffer_size;		/* Current size of the frame reassembly buffer */
+	volatile gint frame_buffer_hwm;			/* Largest frame we reassembled so far */
+	volatile gint frame_buffer_truncated;	/* Number of frames that didn't fit in the buffer */
 	int width, height, fps;					/* Video width/height, and advertised FPS */
 	int target_width, target_height;		/* Video width/height to scale to, if needed */
+	enum AVPixelFormat output_format;		/* Format to send unscaled video frames in */
 	char *ndi_name;							/* NDI name */
 	janus_ndi_sender *ndi_sender;			/* NDI audio/video sender */
 	gboolean external_sender;				/* Whether this session owns the NDI sender or not */
 	char *ndi_metadata;						/* NDI metadata, if any */
-	/* Queues */
-	GQueue *audio_buffered_packets, *video_buffered_packets;
+	/* Incoming packets, as queued by the RTP thread */
+	janus_ndi_ring audio_ring, video_ring;
+	/* Pools of buffered packets */
+	janus_ndi_packet_pool audio_pool, video_pool;
+	/* Jitter buffers (only accessed by the audio and video session tasks respectively) */
+	janus_ndi_jitter_buffer audio_jb, video_jb;
+	volatile gint buffer_size;				/* Buffer size for this session, in us (-1 to use the plugin default) */
 	/* Path to disconnected image and background color, if any */
 	char *disconnected, *disconnected_color;
-	/* Translation thread */
-	GThread *thread;
+	/* Translation tasks */
+	janus_ndi_task video_task, audio_task;
+	janus_ndi_video_state *video_state;		/* Video processing state (only accessed by the video task) */
+	volatile gint audio_running;			/* Whether the audio task is still active */
+	gint64 audio_destroyed;					/* When the audio task started wrapping up */
+	float *audio_pcm;						/* Decoded audio, interleaved and planar (only accessed by the audio task) */
+	int audio_frame_samples;				/* Samples per channel in each NDI audio frame (0 means one frame per packet) */
+	int audio_pending;						/* Planar samples waiting to fill an NDI audio frame (only accessed by the audio task) */
+	volatile gint audio_buffered;			/* Same as above, for stats */
+	volatile gint audio_packets;			/* Number of Opus packets decoded so far */
+	volatile gint audio_frames;				/* Number of audio frames sent to NDI so far */
+	uint32_t audio_next_ts;					/* RTP timestamp we expect the next audio packet to have */
+	gboolean audio_next_ts_valid;			/* Whether the above is valid */
+	volatile gint audio_concealed;			/* Number of samples concealed (PLC) after losses */
+	volatile gint audio_fec;				/* Number of lost packets decoded from in-band FEC */
+	uint32_t audio_pending_ts;				/* RTP timestamp of the first pending planar sample */
+	uint32_t audio_queue_ts;				/* RTP timestamp we expect the next queued samples to have */
+	struct SwrContext *audio_swr;			/* Resampler, to compensate the clock drift (only accessed by the audio task) */
+	int audio_compensation_left;			/* Samples left before we need to update the compensation */
+	double audio_compensation_rest;			/* Fraction of a sample we still need to compensate */
+	volatile gint audio_compensated;		/* Samples added (or removed, if negative) by drift compensation */
+	volatile gint video_repeated;			/* Video frames repeated to compensate the clock drift */
+	volatile gint video_dropped;			/* Video frames dropped to compensate the clock drift */
+	volatile gint video_recovered;			/* Missing video packets that arrived while we were waiting for them */
+	volatile gint video_undecodable;		/* Video frames we skipped because they depended on lost ones */
+	volatile gint video_keyframe_waits;		/* How many times a loss forced us to wait for a keyframe */
+	volatile gint video_layer_cap;			/* Highest temporal layer we decode (-1 if we decode them all) */
+	volatile gint video_layer_dropped;		/* Video frames of higher temporal layers we didn't decode */
+	volatile gint keyframe_request;			/* Whether a keyframe was requested via the API */
+	volatile gint keyframes_requested;		/* PLIs and FIRs we sent */
+	volatile gint keyframes_fir;			/* How many of those were FIRs */
+	volatile gint keyframes_received;		/* Keyframes we got */
+	volatile gint keyframes_deferred;		/* Requests we postponed as the plugin-wide budget was exhausted */
+	/* Sender clocks, as learned from RTCP (protected by the session mutex) */
+	janus_ndi_clock audio_clock, video_clock;
 	/* Struct info */
 	volatile gint audio, video;
 	volatile gint paused;
@@ -366,10 +1614,12 @@ static void janus_ndi_session_free(const janus_refcount *session_ref) {
 	g_free(session->ndi_metadata);
 	g_free(session->disconnected);
 	g_free(session->disconnected_color);
-	if(session->audio_buffered_packets)
-		g_queue_free_full(session->audio_buffered_packets, (GDestroyNotify)janus_ndi_buffer_packet_destroy);
-	if(session->video_buffered_packets)
-		g_queue_free_full(session->video_buffered_packets, (GDestroyNotify)janus_ndi_buffer_packet_destroy);
+	janus_ndi_jitter_buffer_free(&session->audio_jb);
+	janus_ndi_jitter_buffer_free(&session->video_jb);
+	janus_ndi_ring_free(&session->audio_ring);
+	janus_ndi_ring_free(&session->video_ring);
+	janus_ndi_packet_pool_free(&session->audio_pool);
+	janus_ndi_packet_pool_free(&session->video_pool);
 	/* Done */
 	g_free(session);
 	session = NULL;
@@ -397,31 +1647,68 @@ static void janus_ndi_message_free(janus_ndi_message *msg) {
 	g_free(msg);
 }
 
-/* Helper to check if an RTP packet is out of order */
-static gboolean janus_ndi_rtp_is_outoforder(janus_ndi_session *session, janus_rtp_header *header, gboolean video) {
-	if(header == NULL || session == NULL)
-		return FALSE;
-	uint16_t seq = ntohs(header->seq_number);
-	uint16_t max_seq_nr = (video ? session->v_max_seq_nr : session->a_max_seq_nr);
-	if((int16_t)(seq - max_seq_nr) > 0) {
-		/* Packet is in order, update max_seq_nr */
-		if(video)
-			session->v_max_seq_nr = seq;
-		else
-			session->a_max_seq_nr = seq;
-		return FALSE;
-	} else {
-		/* Packet is out of order */
-		JANUS_LOG(LOG_WARN, "Out of order packet (%"SCNu16", expecting %"SCNu16")\n",
-			seq, (max_seq_nr+1));
-		return TRUE;
+/* Helper to move packets queued by the RTP thread to the jitter buffer:
+ * only invoked by the audio or video session task, so the buffers need no locking */
+static void janus_ndi_buffer_packets_drain(janus_ndi_session *session, gboolean video) {
+	janus_ndi_ring *ring = video ? &session->video_ring : &session->audio_ring;
+	janus_ndi_jitter_buffer *jb = video ? &session->video_jb : &session->audio_jb;
+	janus_ndi_buffer_packet *pkt = NULL;
+	while((pkt = janus_ndi_ring_pop(ring)) != NULL) {
+		if(!janus_ndi_jitter_buffer_insert(jb, pkt)) {
+			JANUS_LOG(LOG_VERB, "[%s] Dropping duplicate or late %s packet (seq=%"SCNu16")\n",
+				session->ndi_name, video ? "video" : "audio", pkt->seq_number);
+			janus_ndi_buffer_packet_destroy(pkt);
+		}
+	}
+}
+
+/* Helper to figure out how long packets should be buffered for a session:
+ * a buffer size explicitly requested for the session wins, otherwise if
+ * the buffer is adaptive we use the largest of the audio and video
+ * targets for both, so that they're still played out in sync */
+static gint64 janus_ndi_session_buffer_size(janus_ndi_session *session) {
+	gint bs = g_atomic_int_get(&session->buffer_size);
+	if(bs >= 0)
+		return bs;
+	if(!adaptive_buffer)
+		return buffer_size;
+	gint64 audio = session->audiodec ? g_atomic_int_get(&session->audio_jb.target) : 0;
+	gint64 video = session->ctx ? g_atomic_int_get(&session->video_jb.target) : 0;
+	if(audio == 0 && video == 0)
+		return buffer_size;
+	return MAX(audio, video);
+}
+
+/* Helper to get the NDI timecode (100ns units) of an audio or video RTP
+ * timestamp, using the sender clock learned via RTCP: we only do that once
+ * we have sender reports for all the streams in the session, so that audio
+ * and video timecodes are always based on the same clock, and otherwise
+ * let NDI synthesize timecodes from the time frames are sent */
+static int64_t janus_ndi_session_timecode(janus_ndi_session *session, gboolean video, uint32_t rtp_ts) {
+	int64_t timecode = NDIlib_send_timecode_synthesize;
+	janus_mutex_lock(&session->mutex);
+	janus_ndi_clock *clock = video ? &session->video_clock : &session->audio_clock;
+	janus_ndi_clock *other = video ? &session->audio_clock : &session->video_clock;
+	gboolean other_needed = video ? (session->audiodec != NULL) : (session->ctx != NULL);
+	if(clock->valid && (other->valid || !other_needed)) {
+		int64_t offset = (int64_t)((int32_t)(rtp_ts - clock->rtp_ts)) * 10000000 / clock->clock_rate;
+		timecode = clock->wallclock*10 + offset;
 	}
+	janus_mutex_unlock(&session->mutex);
+	return timecode;
 }
 
-/* NDI placeholder thread, if required */
-static void *janus_ndi_placeholder_thread(void *data);
-/* Audio/video processing thread */
-static void *janus_ndi_processing_thread(void *data);
+/* NDI placeholder task, if required */
+static gint64 janus_ndi_placeholder_task_run(janus_ndi_task *task);
+static void janus_ndi_placeholder_task_done(janus_ndi_task *task);
+/* Video processing task */
+static gint64 janus_ndi_video_task_run(janus_ndi_task *task);
+static void janus_ndi_video_task_stop(janus_ndi_session *session);
+static void janus_ndi_video_task_done(janus_ndi_task *task);
+/* Audio processing task */
+static gint64 janus_ndi_audio_task_run(janus_ndi_task *task);
+static void janus_ndi_audio_task_done(janus_ndi_task *task);
+static struct SwrContext *janus_ndi_audio_resampler_create(void);
 
 /* Error codes */
 #define JANUS_NDI_ERROR_UNKNOWN_ERROR		499
@@ -440,6 +1727,22 @@ static void *janus_ndi_processing_thread(void *data);
 #define JANUS_NDI_ERROR_IMAGE				452
 #define JANUS_NDI_ERROR_THREAD				453
 
+/* Helper to parse the buffer size a session asks for: -1 means the plugin
+ * defaults (adaptive buffer included), 0 no buffering at all, anything
+ * else a fixed size in ms. Returns 0 and the size in us if valid, or an
+ * error code (with the error cause filled in) otherwise */
+static int janus_ndi_session_buffer_parse(json_t *buffer, gint64 *size, char *error_cause, int error_len) {
+	gint64 bs = json_integer_value(buffer);
+	if(bs < -1 || bs > JANUS_NDI_BUFFER_MAX_MS) {
+		JANUS_LOG(LOG_ERR, "Invalid buffer size %"SCNi64"\n", bs);
+		g_snprintf(error_cause, error_len, "Invalid buffer size %"SCNi64" (should be -1 for the default, or 0-%d)",
+			bs, JANUS_NDI_BUFFER_MAX_MS);
+		return JANUS_NDI_ERROR_INVALID_ELEMENT;
+	}
+	*size = bs < 0 ? -1 : bs*1000;
+	return 0;
+}
+
 
 /* Plugin implementation */
 int janus_ndi_init(janus_callbacks *callback, const char *config_path) {
@@ -483,13 +1786,138 @@ int janus_ndi_init(janus_callbacks *callback, const char *config_path) {
 		if(item && item->value) {
 			/* Enforce buffer size */
 			int bs = atoi(item->value);
-			if(bs < 0) {
-				JANUS_LOG(LOG_WARN, "Invalid buffer size %s, falling back to %"SCNi64"\n", item->value, buffer_size);
+			if(bs < 0 || bs > JANUS_NDI_BUFFER_MAX_MS) {
+				JANUS_LOG(LOG_WARN, "Invalid buffer size %s, falling back to %"SCNi64"\n", item->value, buffer_size/1000);
 			} else {
 				buffer_size = bs*1000;
 				JANUS_LOG(LOG_INFO, "Setting buffer size to %dms\n", bs);
 			}
 		}
+		/* Check if sessions should adapt the buffer size to network conditions */
+		item = janus_config_get(config, config_general, janus_config_type_item, "adaptive_buffer");
+		if(item && item->value)
+			adaptive_buffer = janus_is_true(item->value);
+		if(adaptive_buffer) {
+			item = janus_config_get(config, config_general, janus_config_type_item, "buffer_min");
+			if(item && item->value) {
+				int bs = atoi(item->value);
+				if(bs < 0 || bs > JANUS_NDI_BUFFER_MAX_MS)
+					JANUS_LOG(LOG_WARN, "Invalid minimum buffer size %s, ignoring\n", item->value);
+				else
+					buffer_min = bs*1000;
+			}
+			item = janus_config_get(config, config_general, janus_config_type_item, "buffer_max");
+			if(item && item->value) {
+				int bs = atoi(item->value);
+				if(bs < 0 || bs > JANUS_NDI_BUFFER_MAX_MS)
+					JANUS_LOG(LOG_WARN, "Invalid maximum buffer size %s, ignoring\n", item->value);
+				else
+					buffer_max = bs*1000;
+			}
+			if(buffer_max < buffer_min) {
+				JANUS_LOG(LOG_WARN, "Maximum buffer size smaller than the minimum, using %"SCNi64"ms for both\n",
+					buffer_min/1000);
+				buffer_max = buffer_min;
+			}
+			JANUS_LOG(LOG_INFO, "Adaptive buffer enabled (%"SCNi64"ms-%"SCNi64"ms)\n",
+				buffer_min/1000, buffer_max/1000);
+		}
+		/* Check how large video frames can get */
+		item = janus_config_get(config, config_general, janus_config_type_item, "frame_buffer_max");
+		if(item && item->value) {
+			int fbm = atoi(item->value);
+			if(fbm <= 0 || fbm > 256*1024)
+				JANUS_LOG(LOG_WARN, "Invalid maximum frame buffer size %s, using %dkB\n", item->value, frame_buffer_max/1024);
+			else
+				frame_buffer_max = fbm*1024;
+		}
+		/* Check how many workers we should use for audio/video processing */
+		item = janus_config_get(config, config_general, janus_config_type_item, "workers");
+		if(item && item->value) {
+			int w = atoi(item->value);
+			if(w < 0)
+				JANUS_LOG(LOG_WARN, "Invalid number of workers %s, using one per core\n", item->value);
+			else
+				num_workers = w;
+		}
+		/* Check if we should aggregate or split decoded audio before sending it */
+		item = janus_config_get(config, config_general, janus_config_type_item, "audio_frame_size");
+		if(item && item->value) {
+			int afs = atoi(item->value);
+			if(afs != 0 && (afs < JANUS_NDI_AUDIO_FRAME_MIN || afs > JANUS_NDI_AUDIO_FRAME_MAX))
+				JANUS_LOG(LOG_WARN, "Invalid audio frame size %s, sending one frame per packet\n", item->value);
+			else
+				audio_frame_size = afs;
+		}
+		/* Check how we should ask for keyframes, and how often */
+		item = janus_config_get(config, config_general, janus_config_type_item, "keyframe_method");
+		if(item && item->value) {
+			int method = janus_ndi_keyframe_method_from_name(item->value);
+			if(method < 0)
+				JANUS_LOG(LOG_WARN, "Invalid keyframe method %s, using auto\n", item->value);
+			else
+				keyframe_method = method;
+		}
+		item = janus_config_get(config, config_general, janus_config_type_item, "keyframe_budget");
+		if(item && item->value) {
+			int kb = atoi(item->value);
+			if(kb < 0)
+				JANUS_LOG(LOG_WARN, "Invalid keyframe budget %s, using %d\n", item->value, keyframe_budget);
+			else
+				keyframe_budget = kb;
+		}
+		/* Check if we should compensate the clock drift of senders */
+		item = janus_config_get(config, config_general, janus_config_type_item, "drift_compensation");
+		if(item && item->value)
+			drift_compensation = janus_is_true(item->value);
+		/* Check if video frames should be sent to NDI synchronously instead */
+		item = janus_config_get(config, config_general, janus_config_type_item, "async_send");
+		if(item && item->value)
+			async_send = janus_is_true(item->value);
+		/* Check if we can send frames in a format other than UYVY */
+		item = janus_config_get(config, config_general, janus_config_type_item, "output_format");
+		if(item && item->value) {
+			enum AVPixelFormat format = janus_ndi_output_format_from_name(item->value);
+			if(format == AV_PIX_FMT_NONE)
+				JANUS_LOG(LOG_WARN, "Invalid output format %s, using uyvy\n", item->value);
+			else
+				output_format = format;
+		}
+		/* Check if we should use our own conversion kernels, and benchmark them */
+		item = janus_config_get(config, config_general, janus_config_type_item, "fast_conversion");
+		if(item && item->value)
+			fast_conversion = janus_is_true(item->value);
+		item = janus_config_get(config, config_general, janus_config_type_item, "benchmark_conversion");
+		if(item && item->value)
+			benchmark_conversion = janus_is_true(item->value);
+		/* Check if any video decoder should use multiple threads */
+		janus_config_category *config_decoders = janus_config_get(config, NULL, janus_config_type_category, "decoders");
+		size_t i = 0;
+		for(i=0; config_decoders && i<sizeof(decoder_threading)/sizeof(*decoder_threading); i++) {
+			janus_ndi_decoder_threading *dt = &decoder_threading[i];
+			const char *vcodec = janus_videocodec_name(dt->vcodec);
+			janus_config_category *cat = janus_config_get(config, config_decoders, janus_config_type_category, vcodec);
+			if(cat == NULL)
+				continue;
+			item = janus_config_get(config, cat, janus_config_type_item, "threads");
+			if(item && item->value) {
+				int threads = atoi(item->value);
+				if(threads < 0 || threads > JANUS_NDI_DECODER_THREADS_MAX)
+					JANUS_LOG(LOG_WARN, "Invalid number of %s decoder threads %s, ignoring\n", vcodec, item->value);
+				else
+					dt->threads = threads;
+			}
+			item = janus_config_get(config, cat, janus_config_type_item, "threading");
+			if(item && item->value) {
+				int type = janus_ndi_decoder_threading_type(item->value);
+				if(type < 0)
+					JANUS_LOG(LOG_WARN, "Invalid %s decoder threading %s, ignoring\n", vcodec, item->value);
+				else
+					dt->type = type;
+			}
+			JANUS_LOG(LOG_INFO, "Using %d threads for the %s decoder (%s)\n", dt->threads, vcodec,
+				dt->type == (FF_THREAD_FRAME | FF_THREAD_SLICE) ? "auto" : janus_ndi_decoder_threading_name(dt->type));
+		}
 		item = janus_config_get(config, config_general, janus_config_type_item, "events");
 		if(item != NULL && item->value != NULL)
 			notify_events = janus_is_true(item->value);
@@ -501,6 +1929,15 @@ int janus_ndi_init(janus_callbacks *callback, const char *config_path) {
 	}
 	config = NULL;
 
+	/* Pick the conversion kernels to use */
+	if(fast_conversion) {
+		janus_ndi_convert_init();
+		janus_ndi_convert_check();
+		JANUS_LOG(LOG_INFO, "Using %s conversion kernels\n", janus_ndi_convert.name);
+		if(benchmark_conversion)
+			janus_ndi_convert_benchmark();
+	}
+
 	/* Load test pattern */
 	const AVCodec *codec = avcodec_find_decoder(AV_CODEC_ID_PNG);
 	AVCodecContext *ctx = avcodec_alloc_context3(codec);
@@ -571,6 +2008,14 @@ int janus_ndi_init(janus_callbacks *callback, const char *config_path) {
 	/* This is the callback we'll need to invoke to contact the Janus core */
 	gateway = callback;
 
+	/* Launch the workers that will take care of audio/video processing */
+	if(num_workers == 0)
+		num_workers = g_get_num_processors();
+	if(janus_ndi_workers_start(num_workers) < 0) {
+		janus_ndi_workers_stop();
+		return -1;
+	}
+
 	g_atomic_int_set(&initialized, 1);
 
 	GError *error = NULL;
@@ -581,6 +2026,7 @@ int janus_ndi_init(janus_callbacks *callback, const char *config_path) {
 		JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the NDI handler thread...\n",
 			error->code, error->message ? error->message : "??");
 		g_error_free(error);
+		janus_ndi_workers_stop();
 		return -1;
 	}
 	JANUS_LOG(LOG_INFO, "%s initialized!\n", JANUS_NDI_NAME);
@@ -603,6 +2049,7 @@ void janus_ndi_destroy(void) {
 		g_thread_join(test_pattern_thread);
 		test_pattern_thread = NULL;
 	}
+	janus_ndi_workers_stop();
 	av_freep(&test_pattern->data[0]);
 	test_pattern->data[0] = NULL;
 	av_free(test_pattern);
@@ -676,6 +2123,13 @@ void janus_ndi_create_session(janus_plugin_session *handle, int *error) {
 	g_atomic_int_set(&session->destroyed, 0);
 	g_atomic_int_set(&session->hangingup, 0);
 	janus_mutex_init(&session->mutex);
+	session->video_task.state = JANUS_NDI_TASK_DONE;
+	session->audio_task.state = JANUS_NDI_TASK_DONE;
+	janus_ndi_ring_init(&session->audio_ring, JANUS_NDI_AUDIO_RING_SIZE);
+	janus_ndi_ring_init(&session->video_ring, JANUS_NDI_VIDEO_RING_SIZE);
+	janus_ndi_jitter_buffer_init(&session->audio_jb, JANUS_NDI_AUDIO_JB_SIZE, JANUS_NDI_AUDIO_JB_MAX_SIZE, 48000);
+	janus_ndi_jitter_buffer_init(&session->video_jb, JANUS_NDI_VIDEO_JB_SIZE, JANUS_NDI_VIDEO_JB_MAX_SIZE, 90000);
+	session->buffer_size = -1;
 	handle->plugin_handle = session;
 	/* Done */
 	janus_refcount_init(&session->ref, janus_ndi_session_free);
@@ -733,7 +2187,101 @@ json_t *janus_ndi_query_session(janus_plugin_session *handle) {
 		json_object_set_new(info, "paused", g_atomic_int_get(&session->paused) ? json_true() : json_false());
 		json_object_set_new(info, "send-audio", g_atomic_int_get(&session->audio) ? json_true() : json_false());
 		json_object_set_new(info, "send-video", g_atomic_int_get(&session->video) ? json_true() : json_false());
-		json_object_set_new(info, "buffer-size", json_integer(buffer_size));
+		json_object_set_new(info, "buffer-size", json_integer(janus_ndi_session_buffer_size(session)));
+		janus_mutex_lock(&session->mutex);
+		json_t *reports = json_object();
+		if(session->audiodec)
+			json_object_set_new(reports, "audio", json_integer(session->audio_clock.reports));
+		if(session->ctx)
+			json_object_set_new(reports, "video", json_integer(session->video_clock.reports));
+		json_object_set_new(info, "sender-reports", reports);
+		janus_mutex_unlock(&session->mutex);
+		if(session->audiodec) {
+			json_t *queue = json_object();
+			json_object_set_new(queue, "ring-depth", json_integer(janus_ndi_ring_depth(&session->audio_ring)));
+			json_object_set_new(queue, "ring-max-depth", json_integer(g_atomic_int_get(&session->audio_ring.max_depth)));
+			json_object_set_new(queue, "ring-overflows", json_integer(g_atomic_int_get(&session->audio_ring.overflows)));
+			if(session->audio_pool.slab != NULL) {
+				json_object_set_new(queue, "pool-available", json_integer(janus_ndi_ring_depth(&session->audio_pool.free)));
+				json_object_set_new(queue, "pool-misses", json_integer(g_atomic_int_get(&session->audio_pool.misses)));
+			}
+			json_object_set_new(queue, "buffered", json_integer(g_atomic_int_get(&session->audio_jb.count)));
+			json_object_set_new(queue, "reordered", json_integer(g_atomic_int_get(&session->audio_jb.reordered)));
+			json_object_set_new(queue, "duplicates", json_integer(g_atomic_int_get(&session->audio_jb.duplicates)));
+			json_object_set_new(queue, "late", json_integer(g_atomic_int_get(&session->audio_jb.late)));
+			json_object_set_new(queue, "lost", json_integer(g_atomic_int_get(&session->audio_jb.lost)));
+			json_object_set_new(queue, "resets", json_integer(g_atomic_int_get(&session->audio_jb.resets)));
+			json_object_set_new(queue, "jitter", json_integer(g_atomic_int_get(&session->audio_jb.jitter)));
+			json_object_set_new(queue, "drift", json_integer(g_atomic_int_get(&session->audio_jb.drift_ppm)));
+			if(adaptive_buffer)
+				json_object_set_new(queue, "buffer-target", json_integer(g_atomic_int_get(&session->audio_jb.target)));
+			json_object_set_new(info, "audio-queue", queue);
+			json_t *output = json_object();
+			json_object_set_new(output, "frame-size", json_integer(session->audio_frame_samples/48));
+			json_object_set_new(output, "packets", json_integer(g_atomic_int_get(&session->audio_packets)));
+			json_object_set_new(output, "frames", json_integer(g_atomic_int_get(&session->audio_frames)));
+			json_object_set_new(output, "buffered", json_integer(g_atomic_int_get(&session->audio_buffered)/48));
+			json_object_set_new(output, "concealed", json_integer(g_atomic_int_get(&session->audio_concealed)/48));
+			json_object_set_new(output, "fec", json_integer(g_atomic_int_get(&session->audio_fec)));
+			if(drift_compensation)
+				json_object_set_new(output, "drift-compensated", json_integer(g_atomic_int_get(&session->audio_compensated)));
+			json_object_set_new(info, "audio-output", output);
+		}
+		if(session->ctx) {
+			json_t *queue = json_object();
+			json_object_set_new(queue, "ring-depth", json_integer(janus_ndi_ring_depth(&session->video_ring)));
+			json_object_set_new(queue, "ring-max-depth", json_integer(g_atomic_int_get(&session->video_ring.max_depth)));
+			json_object_set_new(queue, "ring-overflows", json_integer(g_atomic_int_get(&session->video_ring.overflows)));
+			if(session->video_pool.slab != NULL) {
+				json_object_set_new(queue, "pool-available", json_integer(janus_ndi_ring_depth(&session->video_pool.free)));
+				json_object_set_new(queue, "pool-misses", json_integer(g_atomic_int_get(&session->video_pool.misses)));
+			}
+			json_object_set_new(queue, "buffered", json_integer(g_atomic_int_get(&session->video_jb.count)));
+			json_object_set_new(queue, "reordered", json_integer(g_atomic_int_get(&session->video_jb.reordered)));
+			json_object_set_new(queue, "duplicates", json_integer(g_atomic_int_get(&session->video_jb.duplicates)));
+			json_object_set_new(queue, "late", json_integer(g_atomic_int_get(&session->video_jb.late)));
+			json_object_set_new(queue, "lost", json_integer(g_atomic_int_get(&session->video_jb.lost)));
+			json_object_set_new(queue, "resets", json_integer(g_atomic_int_get(&session->video_jb.resets)));
+			json_object_set_new(queue, "jitter", json_integer(g_atomic_int_get(&session->video_jb.jitter)));
+			json_object_set_new(queue, "drift", json_integer(g_atomic_int_get(&session->video_jb.drift_ppm)));
+			json_object_set_new(queue, "recovered", json_integer(g_atomic_int_get(&session->video_recovered)));
+			if(adaptive_buffer)
+				json_object_set_new(queue, "buffer-target", json_integer(g_atomic_int_get(&session->video_jb.target)));
+			json_object_set_new(info, "video-queue", queue);
+		}
+		if(session->ctx) {
+			json_t *decoder = json_object();
+			json_object_set_new(decoder, "threads", json_integer(session->decoder_threads));
+			json_object_set_new(decoder, "threading", json_string(janus_ndi_decoder_threading_name(session->decoder_threading)));
+			json_object_set_new(decoder, "frames", json_integer(g_atomic_int_get(&session->decoded_frames)));
+			json_object_set_new(decoder, "latency", json_integer(g_atomic_int_get(&session->decode_latency)));
+			json_object_set_new(decoder, "latency-max", json_integer(g_atomic_int_get(&session->decode_latency_max)));
+			json_object_set_new(decoder, "undecodable", json_integer(g_atomic_int_get(&session->video_undecodable)));
+			json_object_set_new(decoder, "keyframe-waits", json_integer(g_atomic_int_get(&session->video_keyframe_waits)));
+			if(g_atomic_int_get(&session->video_layer_cap) >= 0)
+				json_object_set_new(decoder, "temporal-layers", json_integer(g_atomic_int_get(&session->video_layer_cap)+1));
+			json_object_set_new(decoder, "layer-dropped", json_integer(g_atomic_int_get(&session->video_layer_dropped)));
+			json_object_set_new(info, "video-decoder", decoder);
+			json_t *keyframes = json_object();
+			json_object_set_new(keyframes, "requested", json_integer(g_atomic_int_get(&session->keyframes_requested)));
+			json_object_set_new(keyframes, "fir", json_integer(g_atomic_int_get(&session->keyframes_fir)));
+			json_object_set_new(keyframes, "received", json_integer(g_atomic_int_get(&session->keyframes_received)));
+			json_object_set_new(keyframes, "deferred", json_integer(g_atomic_int_get(&session->keyframes_deferred)));
+			json_object_set_new(info, "keyframes", keyframes);
+			json_t *fb = json_object();
+			json_object_set_new(fb, "size", json_integer(g_atomic_int_get(&session->frame_buffer_size)));
+			json_object_set_new(fb, "max-size", json_integer(frame_buffer_max));
+			json_object_set_new(fb, "high-water-mark", json_integer(g_atomic_int_get(&session->frame_buffer_hwm)));
+			json_object_set_new(fb, "truncated", json_integer(g_atomic_int_get(&session->frame_buffer_truncated)));
+			json_object_set_new(info, "frame-buffer", fb);
+			json_object_set_new(info, "output-format", json_string(janus_ndi_output_format_name(session->output_format)));
+			if(drift_compensation && session->fps > 0) {
+				json_t *drift = json_object();
+				json_object_set_new(drift, "repeated", json_integer(g_atomic_int_get(&session->video_repeated)));
+				json_object_set_new(drift, "dropped", json_integer(g_atomic_int_get(&session->video_dropped)));
+				json_object_set_new(info, "video-drift", drift);
+			}
+		}
 		if(session->ndi_sender) {
 			json_object_set_new(info, "placeholder", session->ndi_sender->placeholder ? json_true() : json_false());
 			json_object_set_new(info, "busy", session->ndi_sender->busy ? json_true() : json_false());
@@ -1246,59 +2794,30 @@ void janus_ndi_incoming_rtp(janus_plugin_session *handle, janus_plugin_rtp *pack
 #else
 			janus_rtp_header_update(rtp, &session->artpctx, FALSE, 0);
 #endif
-			/* Queue the audio packet (we won't decode now, there might be buffering involved) */
-			janus_ndi_buffer_packet *pkt = janus_ndi_buffer_packet_create(buf, len);
-			janus_mutex_lock(&session->mutex);
-			g_queue_insert_sorted(session->audio_buffered_packets, pkt, (GCompareDataFunc)janus_ndi_buffer_packet_compare, NULL);
-			/* If this packet is out-of-order, fix the inserted time */
-			if(janus_ndi_rtp_is_outoforder(session, rtp, FALSE)) {
-				/* Out of order */
-				JANUS_LOG(LOG_WARN, "[%s] Out of order audio packet\n", session->ndi_name);
-				GList *item = g_queue_find(session->audio_buffered_packets, pkt);
-				janus_ndi_buffer_packet *prev = NULL;
-				if(item && item->prev && item->prev->data)
-					prev = (janus_ndi_buffer_packet *)item->prev->data;
-				else if(item && item->next && item->next->data)
-					prev = (janus_ndi_buffer_packet *)item->next->data;
-				if(prev != NULL) {
-					JANUS_LOG(LOG_HUGE, "[%s]   >> Fixing inserted time: %"SCNi64" --> %"SCNi64"\n",
-						session->ndi_name, pkt->inserted, prev->inserted);
-					pkt->inserted = prev->inserted;
-				}
-			}
-			janus_mutex_unlock(&session->mutex);
 		} else {
-			/* Video, check if the timestamp changed: marker bit is not mandatory, and may be lost as well */
-			if(session->ctx) {
-				/* Fix the RTP header, if needed */
 #if (JANUS_PLUGIN_API_VERSION < 100)
-				janus_rtp_header_update(rtp, &session->rtpctx, TRUE, 0);
+			janus_rtp_header_update(rtp, &session->rtpctx, TRUE, 0);
 #else
-				janus_rtp_header_update(rtp, &session->vrtpctx, TRUE, 0);
+			janus_rtp_header_update(rtp, &session->vrtpctx, TRUE, 0);
 #endif
-				/* Queue the video packet (we won't decode now, there might be buffering involved) */
-				janus_ndi_buffer_packet *pkt = janus_ndi_buffer_packet_create(buf, len);
-				janus_mutex_lock(&session->mutex);
-				g_queue_insert_sorted(session->video_buffered_packets, pkt, (GCompareDataFunc)janus_ndi_buffer_packet_compare, NULL);
-				/* If this packet is out-of-order, fix the inserted time */
-				if(janus_ndi_rtp_is_outoforder(session, rtp, TRUE)) {
-					/* Out of order */
-					JANUS_LOG(LOG_WARN, "[%s] Out of order video packet\n", session->ndi_name);
-					GList *item = g_queue_find(session->video_buffered_packets, pkt);
-					janus_ndi_buffer_packet *prev = NULL;
-					if(item && item->prev && item->prev->data)
-						prev = (janus_ndi_buffer_packet *)item->prev->data;
-					else if(item && item->next && item->next->data)
-						prev = (janus_ndi_buffer_packet *)item->next->data;
-					if(prev != NULL) {
-						JANUS_LOG(LOG_HUGE, "[%s]   >> Fixing inserted time: %"SCNi64" --> %"SCNi64"\n",
-							session->ndi_name, pkt->inserted, prev->inserted);
-						pkt->inserted = prev->inserted;
-					}
-				}
-				janus_mutex_unlock(&session->mutex);
-			}
 		}
+		/* Queue the packet (we won't decode now, there might be buffering involved):
+		 * the audio or video session task will take care of reordering it */
+		janus_ndi_ring *ring = video ? &session->video_ring : &session->audio_ring;
+		janus_ndi_buffer_packet *pkt = janus_ndi_buffer_packet_create(video ? &session->video_pool : &session->audio_pool,
+			buf, len, payload, plen);
+		guint depth = janus_ndi_ring_push(ring, pkt);
+		if(depth == 0) {
+			/* The session task isn't keeping up */
+			JANUS_LOG(LOG_WARN, "[%s] %s ring full, dropping packet\n",
+				session->ndi_name, video ? "Video" : "Audio");
+			janus_ndi_buffer_packet_discard(pkt);
+			return;
+		}
+		/* Kick the session task if this packet may change its next deadline
+		 * (empty ring), or if the ring is filling up */
+		if(depth == 1 || depth == ring->size/2)
+			janus_ndi_task_kick(video ? &session->video_task : &session->audio_task);
 	}
 }
 
@@ -1313,6 +2832,35 @@ void janus_ndi_incoming_rtcp(janus_plugin_session *handle, janus_plugin_rtcp *pa
 		}
 		if(g_atomic_int_get(&session->destroyed))
 			return;
+		/* Check if there's a sender report we can use to map RTP timestamps
+		 * to the sender's clock, which we use for the NDI timecodes */
+		char *buf = packet->buffer;
+		int total = packet->length;
+		while(total >= (int)sizeof(janus_rtcp_header)) {
+			janus_rtcp_header *rtcp = (janus_rtcp_header *)buf;
+			if(rtcp->version != 2)
+				break;
+			int length = (ntohs(rtcp->length)+1)*4;
+			if(length > total)
+				break;
+			if(rtcp->type == RTCP_SR && length >= (int)(sizeof(janus_rtcp_header) + 4 + sizeof(sender_info))) {
+				janus_rtcp_sr *sr = (janus_rtcp_sr *)rtcp;
+				uint64_t msw = ntohl(sr->si.ntp_ts_msw), lsw = ntohl(sr->si.ntp_ts_lsw);
+				if(msw >= JANUS_NDI_NTP_UNIX_OFFSET) {
+					janus_mutex_lock(&session->mutex);
+					janus_ndi_clock *clock = packet->video ? &session->video_clock : &session->audio_clock;
+					clock->rtp_ts = ntohl(sr->si.rtp_ts);
+					clock->wallclock = (int64_t)(msw - JANUS_NDI_NTP_UNIX_OFFSET) * G_USEC_PER_SEC +
+						(int64_t)((lsw * G_USEC_PER_SEC) >> 32);
+					clock->clock_rate = packet->video ? 90000 : 48000;
+					clock->valid = TRUE;
+					clock->reports++;
+					janus_mutex_unlock(&session->mutex);
+				}
+			}
+			buf += length;
+			total -= length;
+		}
 		guint32 bitrate = janus_rtcp_get_remb(packet->buffer, packet->length);
 		if(bitrate > 0) {
 			/* If a REMB arrived, make sure we cap it to our configuration, and send it as a video RTCP */
@@ -1346,6 +2894,9 @@ static void janus_ndi_hangup_media_internal(janus_plugin_session *handle) {
 	g_atomic_int_set(&session->video, 1);
 	g_atomic_int_set(&session->paused, 0);
 	g_atomic_int_set(&session->hangup, 1);
+	/* Kick the session tasks, so that they can start wrapping up */
+	janus_ndi_task_kick(&session->video_task);
+	janus_ndi_task_kick(&session->audio_task);
 	g_atomic_int_set(&session->hangingup, 0);
 }
 
@@ -1417,6 +2968,60 @@ static void *janus_ndi_handler(void *data) {
 				if(error_code != 0)
 					goto error;
 			}
+			/* Check if we should override the threading of the video decoder */
+			json_t *dthreads = json_object_get(root, "decoder_threads");
+			if(dthreads != NULL && json_integer_value(dthreads) > JANUS_NDI_DECODER_THREADS_MAX) {
+				JANUS_LOG(LOG_ERR, "Invalid number of decoder threads %"JSON_INTEGER_FORMAT"\n", json_integer_value(dthreads));
+				error_code = JANUS_NDI_ERROR_INVALID_ELEMENT;
+				g_snprintf(error_cause, 512, "Invalid number of decoder threads %"JSON_INTEGER_FORMAT" (should be 0-%d)",
+					json_integer_value(dthreads), JANUS_NDI_DECODER_THREADS_MAX);
+				goto error;
+			}
+			const char *dthreading = json_string_value(json_object_get(root, "decoder_threading"));
+			int decoder_type = -1;
+			if(dthreading != NULL) {
+				decoder_type = janus_ndi_decoder_threading_type(dthreading);
+				if(decoder_type < 0) {
+					JANUS_LOG(LOG_ERR, "Invalid decoder threading %s\n", dthreading);
+					error_code = JANUS_NDI_ERROR_INVALID_ELEMENT;
+					g_snprintf(error_cause, 512, "Invalid decoder threading %s (should be frame, slice or auto)", dthreading);
+					goto error;
+				}
+			}
+			/* Check if we should use a different output format than the default */
+			const char *oformat = json_string_value(json_object_get(root, "output_format"));
+			enum AVPixelFormat session_format = output_format;
+			if(oformat != NULL) {
+				session_format = janus_ndi_output_format_from_name(oformat);
+				if(session_format == AV_PIX_FMT_NONE) {
+					JANUS_LOG(LOG_ERR, "Invalid output format %s\n", oformat);
+					error_code = JANUS_NDI_ERROR_INVALID_ELEMENT;
+					g_snprintf(error_cause, 512, "Invalid output format %s (should be uyvy, i420, nv12 or p216)", oformat);
+					goto error;
+				}
+			}
+			/* Check if we should aggregate or split audio differently than the default */
+			json_t *aframe = json_object_get(root, "audio_frame_size");
+			int session_audio_frame = audio_frame_size;
+			if(aframe != NULL) {
+				session_audio_frame = json_integer_value(aframe);
+				if(session_audio_frame != 0 && (session_audio_frame < JANUS_NDI_AUDIO_FRAME_MIN ||
+						session_audio_frame > JANUS_NDI_AUDIO_FRAME_MAX)) {
+					JANUS_LOG(LOG_ERR, "Invalid audio frame size %d\n", session_audio_frame);
+					error_code = JANUS_NDI_ERROR_INVALID_ELEMENT;
+					g_snprintf(error_cause, 512, "Invalid audio frame size %d (should be 0 or %d-%d)",
+						session_audio_frame, JANUS_NDI_AUDIO_FRAME_MIN, JANUS_NDI_AUDIO_FRAME_MAX);
+					goto error;
+				}
+			}
+			/* Check if we should use a custom buffer size */
+			json_t *buffer = json_object_get(root, "buffer");
+			gint64 session_buffer = -1;
+			if(buffer != NULL) {
+				error_code = janus_ndi_session_buffer_parse(buffer, &session_buffer, error_cause, 512);
+				if(error_code != 0)
+					goto error;
+			}
 			/* Any SDP to handle? If not, something's wrong */
 			const char *msg_sdp_type = json_string_value(json_object_get(msg->jsep, "type"));
 			const char *msg_sdp = json_string_value(json_object_get(msg->jsep, "sdp"));
@@ -1522,7 +3127,7 @@ static void *janus_ndi_handler(void *data) {
 				}
 			}
 			json_t *fps = json_object_get(root, "fps");
-			session->fps = fps ? json_integer_value(h) : 0;
+			session->fps = fps ? json_integer_value(fps) : 0;
 			/* Parse the SDP we got one */
 			char sdperror[100];
 			janus_sdp *offer = janus_sdp_parse(msg_sdp, sdperror, sizeof(sdperror));
@@ -1550,7 +3155,7 @@ static void *janus_ndi_handler(void *data) {
 				JANUS_SDP_OA_AUDIO, TRUE,
 				JANUS_SDP_OA_AUDIO_CODEC, "opus",
 				JANUS_SDP_OA_AUDIO_DIRECTION, JANUS_SDP_RECVONLY,
-				JANUS_SDP_OA_AUDIO_FMTP, "stereo=1",
+				JANUS_SDP_OA_AUDIO_FMTP, "stereo=1;useinbandfec=1",
 				JANUS_SDP_OA_VIDEO, TRUE,
 				JANUS_SDP_OA_VIDEO_CODEC, json_string_value(videocodec),
 				JANUS_SDP_OA_VIDEO_DIRECTION, JANUS_SDP_RECVONLY,
@@ -1570,7 +3175,7 @@ static void *janus_ndi_handler(void *data) {
 						JANUS_SDP_OA_MLINE, JANUS_SDP_AUDIO,
 							JANUS_SDP_OA_CODEC, "opus",
 							JANUS_SDP_OA_DIRECTION, JANUS_SDP_RECVONLY,
-							JANUS_SDP_OA_FMTP, "stereo=1",
+							JANUS_SDP_OA_FMTP, "stereo=1;useinbandfec=1",
 							JANUS_SDP_OA_ACCEPT_EXTMAP, JANUS_RTP_EXTMAP_MID,
 							JANUS_SDP_OA_ACCEPT_EXTMAP, JANUS_RTP_EXTMAP_TRANSPORT_WIDE_CC,
 						JANUS_SDP_OA_DONE);
@@ -1588,6 +3193,11 @@ static void *janus_ndi_handler(void *data) {
 			}
 #endif
 			janus_sdp_destroy(offer);
+			/* Allocate the pools of buffered packets, if we didn't already */
+			if(session->audio_pool.slab == NULL)
+				janus_ndi_packet_pool_init(&session->audio_pool, JANUS_NDI_AUDIO_POOL_SIZE);
+			if(session->video_pool.slab == NULL)
+				janus_ndi_packet_pool_init(&session->video_pool, JANUS_NDI_VIDEO_POOL_SIZE);
 			/* Check which decoders we need */
 			const char *acodec = NULL, *vcodec = NULL;
 #if (JANUS_PLUGIN_API_VERSION < 100)
@@ -1631,10 +3241,22 @@ static void *janus_ndi_handler(void *data) {
 							session->height = 0;
 							session->target_width = 0;
 							session->target_height = 0;
+							session->output_format = session_format;
 							if(width != -1 && height != -1) {
 								session->target_width = width;
 								session->target_height = height;
 							}
+							/* Use the threading configured for this codec, unless
+							 * the session asked for something different */
+							janus_ndi_decoder_threading *dt = janus_ndi_decoder_threading_find(session->vcodec);
+							session->ctx->thread_count = dthreads ? json_integer_value(dthreads) : (dt ? dt->threads : 1);
+							if(decoder_type > 0)
+								session->ctx->thread_type = decoder_type;
+							else if(dt != NULL)
+								session->ctx->thread_type = dt->type;
+							g_atomic_int_set(&session->decoded_frames, 0);
+							g_atomic_int_set(&session->decode_latency, 0);
+							g_atomic_int_set(&session->decode_latency_max, 0);
 							if(avcodec_open2(session->ctx, codec, NULL) < 0) {
 								/* FIXME We ignore this error for now */
 								JANUS_LOG(LOG_ERR, "Error opening video decoder...\n");
@@ -1644,6 +3266,12 @@ static void *janus_ndi_handler(void *data) {
 								av_free(session->ctx);
 								session->ctx = NULL;
 								session->vcodec = JANUS_VIDEOCODEC_NONE;
+							} else {
+								/* Keep track of what the decoder actually went for */
+								session->decoder_threads = session->ctx->thread_count;
+								session->decoder_threading = session->ctx->active_thread_type;
+								JANUS_LOG(LOG_VERB, "[%s] Video decoder using %d threads (%s threading)\n",
+									name, session->decoder_threads, janus_ndi_decoder_threading_name(session->decoder_threading));
 							}
 						}
 					}
@@ -1682,9 +3310,6 @@ static void *janus_ndi_handler(void *data) {
 				NDIlib_send_add_connection_metadata(session->ndi_sender->instance, &NDI_product_type);
 			}
 			janus_mutex_unlock(&session->ndi_sender->mutex);
-			/* Create a queue for buffered packets */
-			session->audio_buffered_packets = g_queue_new();
-			session->video_buffered_packets = g_queue_new();
 			/* Take note of which image to use on disconnect, if provided */
 			if(ondisconnect) {
 				const char *d_path = json_string_value(json_object_get(ondisconnect, "image"));
@@ -1696,6 +3321,13 @@ static void *janus_ndi_handler(void *data) {
 				session->disconnected = g_strdup(d_path);
 				if(d_color)
 					session->disconnected_color = g_strdup(d_color + 1);
+				/* Download and decode the image now (it's cached), as the video
+				 * task that sends it when we're done can't block waiting for it */
+				if(janus_ndi_download_image(session->disconnected) == NULL) {
+					JANUS_LOG(LOG_WARN, "[%s] Couldn't get disconnected image %s, ignoring\n", name, d_path);
+					g_free(session->disconnected);
+					session->disconnected = NULL;
+				}
 			}
 			/* By default we relay both audio and video */
 			g_atomic_int_set(&session->audio, 1);
@@ -1709,23 +3341,69 @@ static void *janus_ndi_handler(void *data) {
 			/* Check if we should be strict when decoding video */
 			json_t *strict = json_object_get(root, "strict");
 			session->strict_decoder = strict ? json_is_true(strict) : FALSE;
+			/* Use a custom buffer size, if we were asked to */
+			g_atomic_int_set(&session->buffer_size, session_buffer);
 
-			/* Spawn a thread */
+			/* Schedule the tasks on the shared workers: audio is handled by a
+			 * separate task, so that decoding, scaling and sending video frames
+			 * can't cause gaps in the audio */
 			g_atomic_int_set(&session->hangup, 0);
+			session->video_state = janus_ndi_video_state_create(session->vcodec);
+			g_atomic_int_set(&session->frame_buffer_size, session->video_state->frame_size);
+			g_atomic_int_set(&session->frame_buffer_hwm, 0);
+			g_atomic_int_set(&session->frame_buffer_truncated, 0);
+			g_atomic_int_set(&session->video_repeated, 0);
+			g_atomic_int_set(&session->video_dropped, 0);
+			g_atomic_int_set(&session->video_recovered, 0);
+			g_atomic_int_set(&session->video_undecodable, 0);
+			g_atomic_int_set(&session->video_keyframe_waits, 0);
+			g_atomic_int_set(&session->video_layer_cap, -1);
+			g_atomic_int_set(&session->video_layer_dropped, 0);
+			g_atomic_int_set(&session->keyframe_request, 0);
+			g_atomic_int_set(&session->keyframes_requested, 0);
+			g_atomic_int_set(&session->keyframes_fir, 0);
+			g_atomic_int_set(&session->keyframes_received, 0);
+			g_atomic_int_set(&session->keyframes_deferred, 0);
+			janus_mutex_lock(&session->mutex);
+			memset(&session->audio_clock, 0, sizeof(session->audio_clock));
+			memset(&session->video_clock, 0, sizeof(session->video_clock));
+			janus_mutex_unlock(&session->mutex);
+			session->audio_destroyed = 0;
 			janus_refcount_increase(&session->ref);
-			const char *warning = NULL;
-			GError *thread_error = NULL;
-			char tname[16];
-			g_snprintf(tname, sizeof(tname), "session %s", session->ndi_name);
-			session->thread = g_thread_try_new(tname, &janus_ndi_processing_thread, session, &thread_error);
-			if(thread_error != NULL) {
-				/* FIXME We ignore this error for now */
-				warning = "Error launching thread";
-				JANUS_LOG(LOG_ERR, "[%s] Got error %d (%s) trying to launch the thread...\n",
-					session->ndi_name, thread_error->code, thread_error->message ? thread_error->message : "??");
-				janus_refcount_decrease(&session->ref);
-				g_error_free(thread_error);
+			janus_ndi_task_init(&session->video_task, janus_ndi_video_task_run, janus_ndi_video_task_done, session);
+			if(session->audiodec != NULL) {
+				janus_refcount_increase(&session->ref);
+				g_atomic_int_set(&session->audio_running, 1);
+				session->audio_pcm = g_malloc((JANUS_NDI_OPUS_MAX_SAMPLES + JANUS_NDI_AUDIO_FIFO_SAMPLES)*2*sizeof(float));
+				session->audio_frame_samples = session_audio_frame*48;
+				session->audio_pending = 0;
+				g_atomic_int_set(&session->audio_buffered, 0);
+				g_atomic_int_set(&session->audio_packets, 0);
+				g_atomic_int_set(&session->audio_frames, 0);
+				session->audio_next_ts_valid = FALSE;
+				g_atomic_int_set(&session->audio_concealed, 0);
+				g_atomic_int_set(&session->audio_fec, 0);
+				session->audio_compensation_left = 0;
+				session->audio_compensation_rest = 0;
+				g_atomic_int_set(&session->audio_compensated, 0);
+				if(drift_compensation) {
+					session->audio_swr = janus_ndi_audio_resampler_create();
+					if(session->audio_swr == NULL)
+						JANUS_LOG(LOG_WARN, "[%s] Couldn't create resampler, audio drift won't be compensated\n", session->ndi_name);
+				}
+				janus_ndi_task_init(&session->audio_task, janus_ndi_audio_task_run, janus_ndi_audio_task_done, session);
 			}
+			/* Also notify event handlers */
+			if(notify_events && gateway->events_is_enabled()) {
+				json_t *info = json_object();
+				json_object_set_new(info, "name", json_string(session->ndi_name));
+				json_object_set_new(info, "event", json_string("starting"));
+				gateway->notify_event(&janus_ndi_plugin, session->handle, info);
+			}
+			JANUS_LOG(LOG_INFO, "[%s] Starting session tasks\n", session->ndi_name);
+			janus_ndi_task_kick(&session->video_task);
+			if(session->audiodec != NULL)
+				janus_ndi_task_kick(&session->audio_task);
 			/* Take note of the SDP (may be useful for UPDATEs or re-INVITEs) */
 			janus_sdp_destroy(session->sdp);
 			session->sdp = answer;
@@ -1735,8 +3413,6 @@ static void *janus_ndi_handler(void *data) {
 			/* Send SDP to the browser */
 			result = json_object();
 			json_object_set_new(result, "event", json_string("translating"));
-			if(warning != NULL)
-				json_object_set_new(result, "warning", json_string(warning));
 			localjsep = json_pack("{ssss}", "type", "answer", "sdp", sdp);
 			g_free(sdp);
 		} else if(!strcasecmp(request_text, "configure")) {
@@ -1745,10 +3421,19 @@ static void *janus_ndi_handler(void *data) {
 				JANUS_NDI_ERROR_MISSING_ELEMENT, JANUS_NDI_ERROR_INVALID_ELEMENT);
 			if(error_code != 0)
 				goto error;
+			json_t *buffer = json_object_get(root, "buffer");
+			gint64 session_buffer = -1;
+			if(buffer != NULL) {
+				error_code = janus_ndi_session_buffer_parse(buffer, &session_buffer, error_cause, 512);
+				if(error_code != 0)
+					goto error;
+			}
 			if(json_is_true(json_object_get(root, "keyframe"))) {
-				/* Send a PLI */
-				JANUS_LOG(LOG_VERB, "[%s] Sending PLI\n", session->ndi_name);
-				gateway->send_pli(session->handle);
+				/* Have the video task ask for a keyframe: it goes through the
+				 * same backoff and plugin-wide budget as our own requests */
+				JANUS_LOG(LOG_VERB, "[%s] Requesting keyframe\n", session->ndi_name);
+				g_atomic_int_set(&session->keyframe_request, 1);
+				janus_ndi_task_kick(&session->video_task);
 			}
 			json_t *b = json_object_get(root, "bitrate");
 			if(b != NULL) {
@@ -1766,6 +3451,18 @@ static void *janus_ndi_handler(void *data) {
 			json_t *v = json_object_get(root, "video");
 			if(v != NULL)
 				g_atomic_int_set(&session->video, json_is_true(v));
+			if(buffer != NULL) {
+				if(session_buffer < 0) {
+					JANUS_LOG(LOG_VERB, "[%s] Setting buffer size: plugin default\n", session->ndi_name);
+				} else {
+					JANUS_LOG(LOG_VERB, "[%s] Setting buffer size: %"SCNi64"ms\n",
+						session->ndi_name, session_buffer/1000);
+				}
+				g_atomic_int_set(&session->buffer_size, session_buffer);
+				/* Kick the session tasks, as their next deadline may have changed */
+				janus_ndi_task_kick(&session->video_task);
+				janus_ndi_task_kick(&session->audio_task);
+			}
 			json_object_set_new(result, "event", json_string("configured"));
 		} else if(!strcasecmp(request_text, "hangup")) {
 			/* Get rid of an ongoing session */
@@ -2017,818 +3714,1434 @@ static void janus_ndi_av1_parse_sh(char *buffer, uint16_t *width, uint16_t *heig
 	*height = janus_ndi_av1_getbits(base, fhbm1+1, &offset)+1;
 }
 
-/* Audio/video processing thread */
-static void *janus_ndi_processing_thread(void *data) {
-	janus_ndi_session *session = (janus_ndi_session *)data;
-	if(!session) {
-		JANUS_LOG(LOG_ERR, "Invalid session, leaving thread...\n");
-		g_thread_unref(g_thread_self());
+/* Helpers to append data to the frame (or AV1 OBU) we're reassembling */
+static const uint8_t janus_ndi_h264_start_code[3] = { 0x00, 0x00, 0x01 };
+static void janus_ndi_video_state_append(janus_ndi_session *session, janus_ndi_video_state *vs,
+		const void *data, int len) {
+	if(vs->truncated || len <= 0)
+		return;
+	if(!janus_ndi_video_state_grow_frame(vs, vs->frame_len + len)) {
+		vs->truncated = TRUE;
+		return;
+	}
+	g_atomic_int_set(&session->frame_buffer_size, vs->frame_size);
+	memcpy(vs->received_frame + vs->frame_len, data, len);
+	vs->frame_len += len;
+}
+static void janus_ndi_video_state_append_obu(janus_ndi_session *session, janus_ndi_video_state *vs,
+		const void *data, int len) {
+	if(vs->truncated || len <= 0)
+		return;
+	if(!janus_ndi_video_state_grow(&vs->obu_data, &vs->obu_size, vs->data_len + len)) {
+		vs->truncated = TRUE;
+		return;
+	}
+	memcpy(vs->obu_data + vs->data_len, data, len);
+	vs->data_len += len;
+}
+
+/* Helper to fill a frame with something that looks like a picture,
+ * i.e., gradients with a bit of noise, to test conversions with */
+static AVFrame *janus_ndi_convert_test_frame(int width, int height) {
+	AVFrame *frame = av_frame_alloc();
+	frame->width = width;
+	frame->height = height;
+	frame->format = AV_PIX_FMT_YUV420P;
+	if(av_image_alloc(frame->data, frame->linesize, width, height, AV_PIX_FMT_YUV420P, 32) < 0) {
+		av_frame_free(&frame);
 		return NULL;
 	}
-	JANUS_LOG(LOG_INFO, "[%s] Starting session thread\n", session->ndi_name);
+	int x = 0, y = 0;
+	for(y=0; y<height; y++) {
+		for(x=0; x<width; x++)
+			frame->data[0][y*frame->linesize[0] + x] = ((x + y) + g_random_int_range(0, 8)) & 0xFF;
+	}
+	for(y=0; y<height/2; y++) {
+		for(x=0; x<width/2; x++) {
+			frame->data[1][y*frame->linesize[1] + x] = (x*255/width + g_random_int_range(0, 4)) & 0xFF;
+			frame->data[2][y*frame->linesize[2] + x] = (y*255/height + g_random_int_range(0, 4)) & 0xFF;
+		}
+	}
+	return frame;
+}
+/* Make sure the kernels we picked give the same result as the C versions,
+ * falling back to those if they don't (which would be a bug) */
+static void janus_ndi_convert_check(void) {
+	int width = 100, height = 36, stride = width*2, half;
+	AVFrame *frame = janus_ndi_convert_test_frame(width, height);
+	if(frame == NULL)
+		return;
+	uint8_t *expected = g_malloc(stride*height), *result = g_malloc(stride*height);
+	for(half=0; half<2; half++) {
+		int t_stride = half ? stride/2 : stride, t_height = half ? height/2 : height;
+		janus_ndi_convert_frame(&janus_ndi_convert_c, half, frame->data, frame->linesize,
+			expected, t_stride, width, height);
+		janus_ndi_convert_frame(&janus_ndi_convert, half, frame->data, frame->linesize,
+			result, t_stride, width, height);
+		if(memcmp(expected, result, t_stride*t_height)) {
+			JANUS_LOG(LOG_WARN, "The %s conversion kernels don't match the C ones, falling back to C\n",
+				janus_ndi_convert.name);
+			janus_ndi_convert = janus_ndi_convert_c;
+			break;
+		}
+	}
+	g_free(expected);
+	g_free(result);
+	av_free(frame->data[0]);
+	av_frame_free(&frame);
+}
+/* Compare our kernels to swscale, in terms of speed and PSNR */
+static void janus_ndi_convert_benchmark(void) {
+	const int sizes[][2] = { { 640, 360 }, { 1280, 720 }, { 1920, 1080 } };
+	int iterations = 50;
+	size_t i = 0;
+	int half = 0, n = 0;
+	JANUS_LOG(LOG_INFO, "Benchmarking the %s conversion kernels against swscale:\n", janus_ndi_convert.name);
+	for(i=0; i<sizeof(sizes)/sizeof(*sizes); i++) {
+		int width = sizes[i][0], height = sizes[i][1];
+		AVFrame *frame = janus_ndi_convert_test_frame(width, height);
+		if(frame == NULL)
+			continue;
+		for(half=0; half<2; half++) {
+			int t_width = half ? width/2 : width, t_height = half ? height/2 : height;
+			int stride = t_width*2;
+			uint8_t *expected = g_malloc(stride*t_height), *result = g_malloc(stride*t_height);
+			struct SwsContext *sws = sws_getContext(width, height, AV_PIX_FMT_YUV420P,
+				t_width, t_height, AV_PIX_FMT_UYVY422, SWS_FAST_BILINEAR, NULL, NULL, NULL);
+			if(sws == NULL) {
+				g_free(expected);
+				g_free(result);
+				continue;
+			}
+			/* swscale first */
+			gint64 start = janus_get_monotonic_time();
+			for(n=0; n<iterations; n++) {
+				sws_scale(sws, (const uint8_t * const*)frame->data, frame->linesize,
+					0, height, &expected, &stride);
+			}
+			gint64 sws_time = janus_get_monotonic_time() - start;
+			sws_freeContext(sws);
+			/* Now our kernels */
+			start = janus_get_monotonic_time();
+			for(n=0; n<iterations; n++) {
+				janus_ndi_convert_frame(&janus_ndi_convert, half, frame->data, frame->linesize,
+					result, stride, width, height);
+			}
+			gint64 kernel_time = janus_get_monotonic_time() - start;
+			/* Compute the PSNR of our output, using swscale as a reference */
+			double mse = 0;
+			int j = 0;
+			for(j=0; j<stride*t_height; j++)
+				mse += (double)(expected[j] - result[j]) * (expected[j] - result[j]);
+			mse /= stride*t_height;
+			char psnr[32];
+			if(mse == 0)
+				g_snprintf(psnr, sizeof(psnr), "bit-exact");
+			else
+				g_snprintf(psnr, sizeof(psnr), "PSNR %.2fdB", 10*log10(255.0*255.0/mse));
+			JANUS_LOG(LOG_INFO, "  -- %dx%d --> %dx%d: swscale %.3fms, %s %.3fms (%.2fx), %s\n",
+				width, height, t_width, t_height,
+				(double)sws_time/iterations/1000, janus_ndi_convert.name, (double)kernel_time/iterations/1000,
+				kernel_time ? (double)sws_time/kernel_time : 0, psnr);
+			g_free(expected);
+			g_free(result);
+		}
+		av_free(frame->data[0]);
+		av_frame_free(&frame);
+	}
+}
 
-	/* Stuff */
-	char *packet = NULL, *payload = NULL;
-	int bytes = 0, plen = 0;
-	opus_int16 opus_samples[960*4];
+/* Helper to send again the last frame we sent, when drift compensation
+ * scheduled a repeat: we only do that one frame after the original, so
+ * that receivers don't get the two back to back */
+static void janus_ndi_video_send_repeat(janus_ndi_session *session, janus_ndi_video_state *vs) {
+	if(vs->repeat_at == 0)
+		return;
+	vs->repeat_at = 0;
+	janus_mutex_lock(&session->ndi_sender->mutex);
+	session->ndi_sender->last_updated = janus_get_monotonic_time();
+	if(async_send) {
+		NDIlib_send_send_video_async_v2(session->ndi_sender->instance, &vs->repeat_frame);
+		vs->async_pending = TRUE;
+	} else {
+		NDIlib_send_send_video_v2(session->ndi_sender->instance, &vs->repeat_frame);
+	}
+	janus_mutex_unlock(&session->ndi_sender->mutex);
+	g_atomic_int_inc(&session->video_repeated);
+}
 
-	/* Video decoding stuff */
-	int canvas_size = 256000;	/* FIXME */
-	uint8_t *received_frame = g_malloc0(canvas_size);
-	uint8_t *obu_data = (session->vcodec == JANUS_VIDEOCODEC_AV1 ? g_malloc0(canvas_size) : NULL);
-	int frame_len = 0, data_len = 0;
-	guint32 prev_ts = 0, last_ts = 0;
-	gboolean prevts_set = FALSE, ts_changed = FALSE, got_video = FALSE, got_keyframe = FALSE, key_frame = FALSE;
-	uint16_t max_seq_nr = 0;
-	uint8_t gaps = 0;
-	gboolean waiting_kf = FALSE;
-	int width = 0, height = 0;
-	AVFrame *frame = NULL, *decoded_frame = av_frame_alloc(), *scaled_frame = NULL, *canvas = NULL;
-	struct SwsContext *sws = NULL, *sws_canvas = NULL;
-	gint64 last_pli = 0;
-	gboolean need_pli = FALSE;
+/* Helper to convert a decoded frame to the format we need, and send it via NDI */
+static int janus_ndi_video_send_frame(janus_ndi_session *session, janus_ndi_video_state *vs) {
+	AVFrame *frame = vs->frame;
+	/* If a repeat is still pending, it goes out before this frame (and
+	 * before we reuse the output buffer it points to) */
+	janus_ndi_video_send_repeat(session, vs);
+	/* If we advertise a frame rate, compensate the clock drift of the sender
+	 * by dropping or repeating a frame, whenever it adds up to a whole one */
+	gboolean repeat = FALSE;
+	if(drift_compensation && session->fps > 0) {
+		vs->drift_frames += session->video_jb.drift / 1000000.0;
+		if(vs->drift_frames >= 1.0) {
+			vs->drift_frames -= 1.0;
+			g_atomic_int_inc(&session->video_dropped);
+			return 0;
+		} else if(vs->drift_frames <= -1.0) {
+			vs->drift_frames += 1.0;
+			repeat = TRUE;
+		}
+	}
+	int target_width = session->target_width ? session->target_width : frame->width;
+	int target_height = session->target_height ? session->target_height : frame->height;
+	/* If the session wants 16-bit frames, we always convert to those; if
+	 * instead no scaling is needed and the decoder gave us 8-bit 4:2:0
+	 * planes, we can send them as they are, if that's what the session wants
+	 * (full range frames go through swscale, as NDI expects studio range) */
+	enum AVPixelFormat format = AV_PIX_FMT_UYVY422;
+	gboolean copy = FALSE;
+#ifdef AV_PIX_FMT_P216
+	if(session->output_format == AV_PIX_FMT_P216) {
+		format = AV_PIX_FMT_P216;
+	} else
+#endif
+	if((session->output_format == AV_PIX_FMT_YUV420P || session->output_format == AV_PIX_FMT_NV12) &&
+			vs->canvas == NULL && target_width == frame->width && target_height == frame->height &&
+			frame->format == AV_PIX_FMT_YUV420P &&
+			frame->width % 2 == 0 && frame->height % 2 == 0) {
+		format = session->output_format;
+		copy = TRUE;
+	}
+	/* Check if our own kernels can take care of the conversion to UYVY,
+	 * which they can if there's no scaling or it's by half (they don't
+	 * convert the range, so full range frames are left to swscale) */
+	gboolean kernel = FALSE, half = FALSE;
+	if(format == AV_PIX_FMT_UYVY422 && fast_conversion && vs->canvas == NULL &&
+			frame->format == AV_PIX_FMT_YUV420P &&
+			frame->width % 2 == 0) {
+		if(target_width == frame->width && target_height == frame->height) {
+			kernel = TRUE;
+		} else if(target_width*2 == frame->width && target_height*2 == frame->height && target_width % 2 == 0) {
+			kernel = TRUE;
+			half = TRUE;
+		}
+	}
+	/* Do we need to (re)configure the scalers and output frames? */
+	if(vs->output_frames[0] == NULL || frame->width != session->width ||
+			frame->height != session->height || frame->format != vs->input_format ||
+			format != vs->output_format || (!kernel && !copy && vs->sws == NULL)) {
+		/* We do: scalers we used before are cached, and output buffers are
+		 * only reallocated if they're too small, so going back to a previous
+		 * resolution doesn't cost any allocation */
+		session->width = frame->width;
+		session->height = frame->height;
+		vs->input_format = frame->format;
+		vs->sws = NULL;
+		const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+		if(kernel) {
+			JANUS_LOG(LOG_INFO, "[%s] Using %s kernels: %dx%d (%s) --> %dx%d (uyvy)\n",
+				session->ndi_name, janus_ndi_convert.name, frame->width, frame->height,
+				av_get_pix_fmt_name(frame->format), target_width, target_height);
+		} else if(!copy) {
+			/* Follow whatever the decoder gave us, e.g., 10-bit frames for VP9 profile 2 */
+			JANUS_LOG(LOG_INFO, "[%s] Using scaler: %dx%d (%s, %d bits) --> %dx%d (%s)\n",
+				session->ndi_name, frame->width, frame->height, av_get_pix_fmt_name(frame->format),
+				desc ? desc->comp[0].depth : 0, target_width, target_height, janus_ndi_output_format_name(format));
+			vs->sws = janus_ndi_video_state_get_scaler(vs,
+				vs->sws_canvas ? target_width : frame->width, vs->sws_canvas ? target_height : frame->height, frame->format,
+				target_width, target_height, format);
+			if(vs->sws == NULL) {
+				/* TODO What should we do?? */
+				JANUS_LOG(LOG_WARN, "[%s] Couldn't initialize scaler...\n", session->ndi_name);
+				return -1;
+			}
+		} else {
+			JANUS_LOG(LOG_INFO, "[%s] Sending decoded frames as they are: %dx%d (%s)\n",
+				session->ndi_name, frame->width, frame->height, janus_ndi_output_format_name(format));
+		}
+		/* NDI expects the planes to be contiguous, with no padding */
+		int size = av_image_get_buffer_size(format, target_width, target_height, 1);
+		if(size < 0) {
+			JANUS_LOG(LOG_WARN, "[%s] Error computing frame buffer size: %d (%s)\n",
+				session->ndi_name, size, av_err2str(size));
+			return -1;
+		}
+		int i = 0, frames = async_send ? JANUS_NDI_OUTPUT_FRAMES : 1;
+		if(size > vs->output_size) {
+			/* Our buffers are too small: we need new ones, once NDI is done with them */
+			JANUS_LOG(LOG_VERB, "[%s] Growing output buffers: %d --> %d bytes\n",
+				session->ndi_name, vs->output_size, size);
+			janus_ndi_video_state_flush(vs, session->ndi_sender);
+			janus_ndi_video_state_free_output(vs);
+			for(i=0; i<frames; i++) {
+				vs->output_buffers[i] = av_malloc(size);
+				vs->output_frames[i] = av_frame_alloc();
+				if(vs->output_buffers[i] == NULL || vs->output_frames[i] == NULL) {
+					JANUS_LOG(LOG_WARN, "[%s] Error allocating frame buffer\n", session->ndi_name);
+					janus_ndi_video_state_free_output(vs);
+					return -1;
+				}
+			}
+			vs->output_size = size;
+		}
+		/* Map the output frames on the buffers: notice that we don't need to
+		 * wait for NDI here, as we'll write to a different frame first anyway */
+		vs->output_format = format;
+		for(i=0; i<frames; i++) {
+			AVFrame *output = vs->output_frames[i];
+			output->width = target_width;
+			output->height = target_height;
+			output->format = format;
+			av_image_fill_arrays(output->data, output->linesize, vs->output_buffers[i],
+				format, target_width, target_height, 1);
+		}
+	}
+	/* Convert the frame to the format we need: when sending asynchronously,
+	 * we use a different output frame than the one NDI may still be compressing */
+	if(async_send)
+		vs->output_index = (vs->output_index + 1) % JANUS_NDI_OUTPUT_FRAMES;
+	vs->scaled_frame = vs->output_frames[vs->output_index];
+	NDIlib_FourCC_video_type_e fourcc = NDIlib_FourCC_type_UYVY;
+	if(format == AV_PIX_FMT_YUV420P) {
+		/* Just copy the planes */
+		av_image_copy(vs->scaled_frame->data, vs->scaled_frame->linesize,
+			(const uint8_t **)frame->data, frame->linesize, AV_PIX_FMT_YUV420P, frame->width, frame->height);
+		fourcc = NDIlib_FourCC_type_I420;
+	} else if(format == AV_PIX_FMT_NV12) {
+		/* Copy the luma plane, and interleave the chroma planes */
+		av_image_copy_plane(vs->scaled_frame->data[0], vs->scaled_frame->linesize[0],
+			frame->data[0], frame->linesize[0], frame->width, frame->height);
+		int x = 0, y = 0;
+		for(y=0; y<frame->height/2; y++) {
+			const uint8_t *u = frame->data[1] + y*frame->linesize[1];
+			const uint8_t *v = frame->data[2] + y*frame->linesize[2];
+			uint8_t *uv = vs->scaled_frame->data[1] + y*vs->scaled_frame->linesize[1];
+			for(x=0; x<frame->width/2; x++) {
+				*uv++ = u[x];
+				*uv++ = v[x];
+			}
+		}
+		fourcc = NDIlib_FourCC_type_NV12;
+	} else if(kernel) {
+		janus_ndi_convert_frame(&janus_ndi_convert, half, frame->data, frame->linesize,
+			vs->scaled_frame->data[0], vs->scaled_frame->linesize[0], frame->width, frame->height);
+	} else {
+		sws_scale(vs->sws, (const uint8_t * const*)(vs->canvas ? vs->canvas->data : frame->data), vs->canvas ? vs->canvas->linesize : frame->linesize,
+			0, vs->canvas ? vs->canvas->height : frame->height, vs->scaled_frame->data, vs->scaled_frame->linesize);
+#ifdef AV_PIX_FMT_P216
+		if(format == AV_PIX_FMT_P216)
+			fourcc = NDIlib_FourCC_type_P216;
+#endif
+	}
+	/* Send via NDI */
+	NDIlib_video_frame_v2_t NDI_video_frame = { 0 };
+	NDI_video_frame.xres = vs->scaled_frame->width;
+	NDI_video_frame.yres = vs->scaled_frame->height;
+	NDI_video_frame.FourCC = fourcc;
+	NDI_video_frame.p_data = vs->scaled_frame->data[0];
+	NDI_video_frame.line_stride_in_bytes = vs->scaled_frame->linesize[0];
+	NDI_video_frame.timecode = NDIlib_send_timecode_synthesize;
+	if(vs->frame->pkt_dts != AV_NOPTS_VALUE)
+		NDI_video_frame.timecode = janus_ndi_session_timecode(session, TRUE, (uint32_t)vs->frame->pkt_dts);
+	NDI_video_frame.frame_format_type = NDIlib_frame_format_type_progressive;
+	janus_mutex_lock(&session->ndi_sender->mutex);
+	if(session->fps > 0) {
+		NDI_video_frame.frame_rate_D = 1;
+		NDI_video_frame.frame_rate_N = session->fps;
+	}
+	session->ndi_sender->last_updated = janus_get_monotonic_time();
+	if(async_send) {
+		/* This returns as soon as NDI takes the frame, which will
+		 * stay in use until the next one we send (or a flush) */
+		NDIlib_send_send_video_async_v2(session->ndi_sender->instance, &NDI_video_frame);
+		vs->async_pending = TRUE;
+	} else {
+		NDIlib_send_send_video_v2(session->ndi_sender->instance, &NDI_video_frame);
+	}
+	janus_mutex_unlock(&session->ndi_sender->mutex);
+	if(repeat) {
+		/* Send the same frame again one frame later, from the task */
+		if(NDI_video_frame.timecode != NDIlib_send_timecode_synthesize)
+			NDI_video_frame.timecode += 10000000 / session->fps;
+		vs->repeat_frame = NDI_video_frame;
+		vs->repeat_at = janus_get_monotonic_time() + vs->frame_interval;
+	}
+	return 0;
+}
 
-	/* Tally monitoring and state */
-	gboolean tally_preview, tally_program;
-	gint64 tally_last_poll = 0;
+/* Video processing task: every run decodes at most one received frame */
+/* Helpers to keep track of VP8/VP9 frames we lost, or couldn't decode */
+static void janus_ndi_video_lost_picture(janus_ndi_video_state *vs, int picid) {
+	if(picid < 0)
+		return;
+	vs->lost_pictures[vs->lost_index] = picid;
+	vs->lost_index = (vs->lost_index + 1) % JANUS_NDI_LOST_PICTURES;
+}
+static void janus_ndi_video_resync(janus_ndi_video_state *vs) {
+	vs->broken_layers = 0;
+	vs->broken_since = 0;
+	int i = 0;
+	for(i=0; i<JANUS_NDI_LOST_PICTURES; i++)
+		vs->lost_pictures[i] = -1;
+}
+static void janus_ndi_video_break_layers(janus_ndi_video_state *vs, int tid) {
+	if(vs->broken_layers == 0)
+		vs->broken_since = janus_get_monotonic_time();
+	vs->broken_layers |= (uint8_t)(0xFF << tid);
+}
+/* Helper to check whether whole VP8/VP9 frames went missing before the one
+ * we're looking at, comparing its picture ID and base layer index to the
+ * previous ones: returns TRUE if base layer frames may be among them, which
+ * means we need a keyframe, or FALSE if what we lost can be dealt with */
+static gboolean janus_ndi_video_frames_missing(janus_ndi_session *session, janus_ndi_video_state *vs) {
+	janus_ndi_frame_info *finfo = &vs->finfo;
+	if(!finfo->parsed || finfo->picid < 0 || vs->last_picid < 0)
+		return FALSE;
+	int lost = (finfo->picid - vs->last_picid - 1) & finfo->picid_max;
+	if(lost <= 0 || lost >= finfo->picid_max/2)
+		return FALSE;
+	JANUS_LOG(LOG_WARN, "[%s] Missing %d video frame(s) before picture %d\n",
+		session->ndi_name, lost, finfo->picid);
+	if(finfo->nrefs >= 0) {
+		/* Flexible mode: each frame tells us what it depends on */
+		int i = 0;
+		for(i=1; i<=lost && i<=JANUS_NDI_LOST_PICTURES; i++)
+			janus_ndi_video_lost_picture(vs, (finfo->picid - i) & finfo->picid_max);
+		return FALSE;
+	}
+	if(finfo->tid >= 0 && finfo->tl0picidx >= 0 && vs->last_tl0picidx >= 0 &&
+			finfo->tl0picidx == ((vs->last_tl0picidx + (finfo->tid == 0 ? 1 : 0)) & 0xFF)) {
+		/* We didn't lose any base layer frame */
+		janus_ndi_video_break_layers(vs, 1);
+		return FALSE;
+	}
+	return TRUE;
+}
+/* Helper to take note of a VP8/VP9 frame we couldn't reassemble: returns
+ * TRUE if we need a keyframe to recover, or FALSE if the frames that will
+ * follow can be decoded anyway (e.g., the frame we lost was not used as a
+ * reference, or belonged to a temporal layer other than the base one) */
+static gboolean janus_ndi_video_frame_lost(janus_ndi_session *session, janus_ndi_video_state *vs) {
+	janus_ndi_frame_info *finfo = &vs->finfo;
+	/* The packets we're missing may include whole frames before this one */
+	gboolean missing = (!vs->key_frame && !vs->waiting_kf && janus_ndi_video_frames_missing(session, vs));
+	if(finfo->parsed) {
+		if(finfo->picid >= 0)
+			vs->last_picid = finfo->picid;
+		if(finfo->tl0picidx >= 0)
+			vs->last_tl0picidx = finfo->tl0picidx;
+	}
+	if(!finfo->parsed || vs->key_frame || missing)
+		return TRUE;
+	janus_ndi_video_lost_picture(vs, finfo->picid);
+	if(finfo->nonref)
+		return FALSE;
+	if(finfo->nrefs >= 0)
+		return FALSE;
+	if(finfo->tid > 0) {
+		janus_ndi_video_break_layers(vs, finfo->tid);
+		return FALSE;
+	}
+	return TRUE;
+}
+/* Helper to check whether the VP8/VP9 frame we reassembled can be decoded,
+ * or it depends on something we lost: if whole frames went missing, the
+ * picture IDs and base layer indexes tell us whether that matters */
+static gboolean janus_ndi_video_frame_decodable(janus_ndi_session *session, janus_ndi_video_state *vs) {
+	janus_ndi_frame_info *finfo = &vs->finfo;
+	if(vs->key_frame) {
+		janus_ndi_video_resync(vs);
+	} else if(session->strict_decoder && !vs->waiting_kf) {
+		/* Check if we missed any frame entirely */
+		if(janus_ndi_video_frames_missing(session, vs)) {
+			vs->waiting_kf = TRUE;
+			vs->need_pli = TRUE;
+		}
+	}
+	if(finfo->parsed) {
+		if(finfo->picid >= 0)
+			vs->last_picid = finfo->picid;
+		if(finfo->tl0picidx >= 0)
+			vs->last_tl0picidx = finfo->tl0picidx;
+	}
+	if(vs->waiting_kf && !vs->key_frame) {
+		/* We're waiting for a keyframe from a previous glitch */
+		JANUS_LOG(LOG_WARN, "[%s] Still waiting for a keyframe to fix the glitch\n", session->ndi_name);
+		return FALSE;
+	}
+	if(vs->key_frame || !finfo->parsed)
+		return TRUE;
+	gboolean decodable = TRUE;
+	if(finfo->nrefs > 0) {
+		/* Check if any of the pictures this frame depends on is missing */
+		int i = 0, j = 0;
+		for(i=0; i<finfo->nrefs && decodable; i++) {
+			int ref = (finfo->picid - finfo->refs[i]) & finfo->picid_max;
+			for(j=0; j<JANUS_NDI_LOST_PICTURES; j++) {
+				if(vs->lost_pictures[j] == ref) {
+					decodable = FALSE;
+					break;
+				}
+			}
+		}
+	} else if(finfo->tid >= 0 && (vs->broken_layers & (1 << finfo->tid))) {
+		/* This temporal layer is broken: we can decode the frame only if it
+		 * just depends on the base layer, which also resyncs the layer */
+		if(finfo->sync && !(vs->broken_layers & 0x01)) {
+			vs->broken_layers &= ~(1 << finfo->tid);
+			JANUS_LOG(LOG_VERB, "[%s] Temporal layer %d resynced\n", session->ndi_name, finfo->tid);
+		} else {
+			decodable = FALSE;
+		}
+	}
+	if(!decodable) {
+		JANUS_LOG(LOG_VERB, "[%s] Video frame depends on data we lost, skipping it\n", session->ndi_name);
+		g_atomic_int_inc(&session->video_undecodable);
+		janus_ndi_video_lost_picture(vs, finfo->picid);
+	}
+	/* If the broken layers don't resync on their own, ask for a keyframe */
+	if(vs->broken_layers && !vs->need_pli && (janus_get_monotonic_time() - vs->broken_since) >= G_USEC_PER_SEC) {
+		JANUS_LOG(LOG_WARN, "[%s] Temporal layers still broken, requesting a keyframe\n", session->ndi_name);
+		vs->need_pli = TRUE;
+		vs->broken_since = janus_get_monotonic_time();
+	}
+	return decodable;
+}
 
-	/* Timers*/
-	gboolean done_something = TRUE;
-	gint64 now = 0, destroyed = 0;
+/* Helper to check whether the VP8/VP9 frame we reassembled belongs to a
+ * temporal layer we don't need, considering the frame rate we were asked
+ * for: since lower layers never depend on higher ones, we can drop those
+ * frames before decoding them, which saves decoding and conversion time */
+static gboolean janus_ndi_video_layer_skip(janus_ndi_session *session, janus_ndi_video_state *vs) {
+	janus_ndi_frame_info *finfo = &vs->finfo;
+	if(session->fps <= 0 || !finfo->parsed || finfo->tid < 0 || finfo->tid >= JANUS_NDI_TEMPORAL_LAYERS)
+		return FALSE;
+	/* Keep track of the frame rate of each layer */
+	int32_t elapsed = (int32_t)(vs->last_ts - vs->layer_ts);
+	if(!vs->layer_ts_set || elapsed < 0 || elapsed > 4*JANUS_NDI_LAYER_WINDOW) {
+		memset(vs->layer_frames, 0, sizeof(vs->layer_frames));
+		vs->layer_ts = vs->last_ts;
+		vs->layer_ts_set = TRUE;
+		elapsed = 0;
+	}
+	vs->layer_frames[finfo->tid]++;
+	if(elapsed >= JANUS_NDI_LAYER_WINDOW) {
+		/* Find the lowest layer that, along with the ones below it, provides
+		 * the frame rate we need (with some tolerance for the measurement) */
+		int cap = 0, frames = 0;
+		for(cap=0; cap<JANUS_NDI_TEMPORAL_LAYERS-1; cap++) {
+			frames += vs->layer_frames[cap];
+			if((double)frames*90000/elapsed >= session->fps*0.9)
+				break;
+		}
+		if(cap != vs->layer_cap) {
+			JANUS_LOG(LOG_INFO, "[%s] Decoding temporal layers up to %d for %d fps\n",
+				session->ndi_name, cap, session->fps);
+			/* Frames in the layers we were dropping may depend on frames we
+			 * dropped, so in strict mode we need to wait for those layers to
+			 * resync (the tolerant decoder can deal with that on its own,
+			 * and there's no reason to ask for a keyframe because of it) */
+			if(cap > vs->layer_cap && session->strict_decoder)
+				janus_ndi_video_break_layers(vs, vs->layer_cap+1);
+			vs->layer_cap = cap;
+			g_atomic_int_set(&session->video_layer_cap,
+				cap < JANUS_NDI_TEMPORAL_LAYERS-1 ? cap : -1);
+		}
+		memset(vs->layer_frames, 0, sizeof(vs->layer_frames));
+		vs->layer_ts = vs->last_ts;
+	}
+	if(vs->key_frame || finfo->tid <= vs->layer_cap)
+		return FALSE;
+	/* Skip the frame, but take note of it as if we had decoded it, so that
+	 * it isn't mistaken for a loss: nothing we decode depends on it anyway,
+	 * and whether its layer was broken doesn't matter as long as we drop it */
+	if(finfo->picid >= 0)
+		vs->last_picid = finfo->picid;
+	if(finfo->tl0picidx >= 0)
+		vs->last_tl0picidx = finfo->tl0picidx;
+	if(finfo->nrefs >= 0)
+		janus_ndi_video_lost_picture(vs, finfo->picid);
+	vs->broken_layers &= (uint8_t)~(0xFF << (vs->layer_cap+1));
+	return TRUE;
+}
 
-	/* Also notify event handlers */
-	if(notify_events && gateway->events_is_enabled()) {
-		json_t *info = json_object();
-		json_object_set_new(info, "name", json_string(session->ndi_name));
-		json_object_set_new(info, "event", json_string("starting"));
-		gateway->notify_event(&janus_ndi_plugin, session->handle, info);
+/* Helper to take a keyframe request out of the plugin-wide budget: returns
+ * FALSE if the budget is exhausted, and the request should wait */
+static gboolean janus_ndi_keyframe_budget_take(gint64 now) {
+	if(keyframe_budget <= 0)
+		return TRUE;
+	janus_mutex_lock(&keyframe_mutex);
+	if(keyframe_tokens_updated == 0) {
+		keyframe_tokens = keyframe_budget;
+	} else {
+		keyframe_tokens += (double)(now - keyframe_tokens_updated) * keyframe_budget / G_USEC_PER_SEC;
+		if(keyframe_tokens > keyframe_budget)
+			keyframe_tokens = keyframe_budget;
 	}
+	keyframe_tokens_updated = now;
+	gboolean allowed = (keyframe_tokens >= 1.0);
+	if(allowed)
+		keyframe_tokens -= 1.0;
+	janus_mutex_unlock(&keyframe_mutex);
+	return allowed;
+}
 
-	while(session) {
-		/* If the user has been removed, we need to wrap up */
-		now = g_get_monotonic_time();
-		if((g_atomic_int_get(&session->destroyed) || g_atomic_int_get(&session->hangup)) && destroyed == 0) {
-			JANUS_LOG(LOG_INFO, "[%s] Marking session thread as destroyed\n", session->ndi_name);
-			destroyed = now;
-		}
-		if(destroyed && (now - destroyed) >= buffer_size)
-			break;
-		if(!done_something) {
-			/* No packet in the previous iteration, sleep a bit */
-			g_usleep(5000);
-		}
-		done_something = FALSE;
-
-		/* Do we have a PLI to send? */
-		if(need_pli && (now-last_pli >= G_USEC_PER_SEC)) {
-			JANUS_LOG(LOG_INFO, "[%s] Sending PLI\n", session->ndi_name);
-			last_pli = now;
-			need_pli = FALSE;
-			gateway->send_pli(session->handle);
-		}
-
-		/* Check if it's time to poll the tally (we query once a second) */
-		if(tally_last_poll == 0)
-			tally_last_poll = now;
-		if(now-tally_last_poll >= G_USEC_PER_SEC) {
-			tally_last_poll = now;
-			NDIlib_tally_t tally_info = { 0 };
-			NDIlib_send_get_tally(session->ndi_sender->instance, &tally_info, 0);
-			if(tally_preview != tally_info.on_preview || tally_program != tally_info.on_program) {
-				/* Something changed, notify */
-				tally_preview = tally_info.on_preview;
-				tally_program = tally_info.on_program;
-				JANUS_LOG(LOG_VERB, "[%s] Tally: preview=%d, program=%d\n", session->ndi_name, tally_preview, tally_program);
-				/* Prepare JSON event */
-				json_t *event = json_object();
-				json_object_set_new(event, "ndi", json_string("event"));
-				json_t *result = json_object();
-				json_object_set_new(result, "event", json_string("tally"));
-				json_object_set_new(result, "name", json_string(session->ndi_name));
-				json_object_set_new(result, "preview", tally_preview ? json_true() : json_false());
-				json_object_set_new(result, "program", tally_program ? json_true() : json_false());
-				json_object_set_new(event, "result", result);
-				gateway->push_event(session->handle, &janus_ndi_plugin, NULL, event, NULL);
-				json_decref(event);
-				/* Also notify event handlers */
-				if(notify_events && gateway->events_is_enabled()) {
-					json_t *info = json_object();
-					json_object_set_new(info, "event", json_string("tally"));
-					json_object_set_new(info, "name", json_string(session->ndi_name));
-					json_object_set_new(info, "preview", tally_preview ? json_true() : json_false());
-					json_object_set_new(info, "program", tally_program ? json_true() : json_false());
-					gateway->notify_event(&janus_ndi_plugin, session->handle, info);
-				}
+/* Helper to start a new backoff cycle for keyframe requests, e.g., after we
+ * got a keyframe: we still never ask more than twice a second */
+static void janus_ndi_video_keyframe_reset(janus_ndi_video_state *vs) {
+	vs->pli_attempts = 0;
+	vs->pli_backoff = JANUS_NDI_KEYFRAME_BACKOFF_MIN;
+	if(vs->last_pli > 0)
+		vs->next_pli = vs->last_pli + JANUS_NDI_KEYFRAME_BACKOFF_MIN;
+}
+
+/* Helper to ask the sender for a keyframe, if we need one and both the backoff
+ * and the plugin-wide budget allow it: PLIs that go unanswered make us wait
+ * longer and longer before asking again, and may be followed by FIRs */
+static void janus_ndi_video_request_keyframe(janus_ndi_session *session, janus_ndi_video_state *vs, gint64 now) {
+	if(!vs->need_pli || now < vs->next_pli)
+		return;
+	if(!janus_ndi_keyframe_budget_take(now)) {
+		/* Try again later, at a random time so that the sessions
+		 * waiting for the budget don't all try at once again */
+		JANUS_LOG(LOG_VERB, "[%s] Keyframe request budget exhausted, deferring request\n", session->ndi_name);
+		g_atomic_int_inc(&session->keyframes_deferred);
+		vs->next_pli = now + g_random_int_range(G_USEC_PER_SEC/keyframe_budget, G_USEC_PER_SEC + 1);
+		return;
+	}
+	gboolean fir = (keyframe_method == JANUS_NDI_KEYFRAME_FIR ||
+		(keyframe_method == JANUS_NDI_KEYFRAME_AUTO && vs->pli_attempts >= JANUS_NDI_KEYFRAME_FIR_AFTER));
+	if(fir) {
+		JANUS_LOG(LOG_INFO, "[%s] Sending FIR (attempt %u)\n", session->ndi_name, vs->pli_attempts+1);
+		char buf[20];
+		janus_rtcp_fir(buf, sizeof(buf), &vs->fir_seq);
+#if (JANUS_PLUGIN_API_VERSION < 100)
+		janus_plugin_rtcp rtcp = { .video = TRUE, .buffer = buf, .length = sizeof(buf) };
+#else
+		janus_plugin_rtcp rtcp = { .mindex = -1, .video = TRUE, .buffer = buf, .length = sizeof(buf) };
+#endif
+		gateway->relay_rtcp(session->handle, &rtcp);
+		g_atomic_int_inc(&session->keyframes_fir);
+	} else {
+		JANUS_LOG(LOG_INFO, "[%s] Sending PLI (attempt %u)\n", session->ndi_name, vs->pli_attempts+1);
+		gateway->send_pli(session->handle);
+	}
+	g_atomic_int_inc(&session->keyframes_requested);
+	vs->pli_attempts++;
+	vs->last_pli = now;
+	vs->next_pli = now + vs->pli_backoff;
+	vs->pli_backoff = MIN(vs->pli_backoff*2, JANUS_NDI_KEYFRAME_BACKOFF_MAX);
+}
+
+/* Helper to figure out when a video packet is due: if packets are missing
+ * before it, we hold it for an extra frame interval, which is the playout
+ * deadline of the frame, rather than giving up on the missing packets right
+ * away, so that retransmissions that are still on their way can fill the
+ * gap and spare us a broken frame (or a keyframe request) */
+static gint64 janus_ndi_video_packet_due(janus_ndi_session *session, janus_ndi_video_state *vs,
+		janus_ndi_buffer_packet *pkt, uint16_t missing, gint64 delay) {
+	gint64 due = pkt->inserted + delay;
+	if(missing == 0)
+		return due;
+	if(!vs->holding || (int16_t)(pkt->seq_number - vs->hold_seq) > 0) {
+		/* Start waiting (a retransmission that only filled part of a gap
+		 * we were already waiting for doesn't count as a new gap) */
+		vs->holding = TRUE;
+		vs->hold_seq = pkt->seq_number;
+		vs->hold_missing = missing;
+		vs->hold_lost = g_atomic_int_get(&session->video_jb.lost);
+	}
+	return due + vs->frame_interval;
+}
+/* Helper to check, when we pop a packet, how many of the packets we were
+ * waiting for actually arrived: the ones the jitter buffer gave up on in
+ * the meanwhile are those that were really lost */
+static void janus_ndi_video_packet_popped(janus_ndi_session *session, janus_ndi_video_state *vs,
+		janus_ndi_buffer_packet *pkt) {
+	if(!vs->holding || (int16_t)(pkt->seq_number - vs->hold_seq) < 0)
+		return;
+	vs->holding = FALSE;
+	guint lost = g_atomic_int_get(&session->video_jb.lost) - vs->hold_lost;
+	if(vs->hold_missing > lost)
+		g_atomic_int_add(&session->video_recovered, vs->hold_missing - lost);
+}
+
+static gint64 janus_ndi_video_task_run(janus_ndi_task *task) {
+	janus_ndi_session *session = (janus_ndi_session *)task->data;
+	janus_ndi_video_state *vs = session->video_state;
+
+	/* Stuff */
+	char *packet = NULL, *payload = NULL;
+	int bytes = 0, plen = 0;
+	uint16_t missing = 0;
+	gboolean done_something = FALSE;
+
+	/* If the user has been removed, we need to wrap up */
+	gint64 now = g_get_monotonic_time();
+	gint64 delay = janus_ndi_session_buffer_size(session);
+	if((g_atomic_int_get(&session->destroyed) || g_atomic_int_get(&session->hangup) ||
+			g_atomic_int_get(&stopping)) && vs->destroyed == 0) {
+		JANUS_LOG(LOG_INFO, "[%s] Marking session tasks as destroyed\n", session->ndi_name);
+		vs->destroyed = now;
+	}
+	/* When the plugin is stopping we don't play out what we have buffered */
+	if(vs->destroyed && ((now - vs->destroyed) >= delay || g_atomic_int_get(&stopping))) {
+		/* Wait for the audio task too, before we get rid of the NDI sender:
+		 * it will kick us when it's done */
+		if(g_atomic_int_get(&session->audio_running))
+			return 0;
+		janus_ndi_video_task_stop(session);
+		return -1;
+	}
+	/* Reorder the packets the RTP thread queued in the meanwhile */
+	janus_ndi_buffer_packets_drain(session, TRUE);
+	delay = janus_ndi_session_buffer_size(session);
+
+	/* Do we have a keyframe request to send? */
+	if(g_atomic_int_compare_and_exchange(&session->keyframe_request, 1, 0)) {
+		janus_ndi_video_keyframe_reset(vs);
+		vs->need_pli = TRUE;
+	}
+	janus_ndi_video_request_keyframe(session, vs, now);
+	/* Is it time to repeat a frame? */
+	if(vs->repeat_at && now >= vs->repeat_at)
+		janus_ndi_video_send_repeat(session, vs);
+
+	/* Check if it's time to poll the tally (we query once a second) */
+	if(vs->tally_last_poll == 0)
+		vs->tally_last_poll = now;
+	if(now-vs->tally_last_poll >= G_USEC_PER_SEC) {
+		vs->tally_last_poll = now;
+		NDIlib_tally_t tally_info = { 0 };
+		NDIlib_send_get_tally(session->ndi_sender->instance, &tally_info, 0);
+		if(vs->tally_preview != tally_info.on_preview || vs->tally_program != tally_info.on_program) {
+			/* Something changed, notify */
+			vs->tally_preview = tally_info.on_preview;
+			vs->tally_program = tally_info.on_program;
+			JANUS_LOG(LOG_VERB, "[%s] Tally: preview=%d, program=%d\n", session->ndi_name, vs->tally_preview, vs->tally_program);
+			/* Prepare JSON event */
+			json_t *event = json_object();
+			json_object_set_new(event, "ndi", json_string("event"));
+			json_t *result = json_object();
+			json_object_set_new(result, "event", json_string("tally"));
+			json_object_set_new(result, "name", json_string(session->ndi_name));
+			json_object_set_new(result, "preview", vs->tally_preview ? json_true() : json_false());
+			json_object_set_new(result, "program", vs->tally_program ? json_true() : json_false());
+			json_object_set_new(event, "result", result);
+			gateway->push_event(session->handle, &janus_ndi_plugin, NULL, event, NULL);
+			json_decref(event);
+			/* Also notify event handlers */
+			if(notify_events && gateway->events_is_enabled()) {
+				json_t *info = json_object();
+				json_object_set_new(info, "event", json_string("tally"));
+				json_object_set_new(info, "name", json_string(session->ndi_name));
+				json_object_set_new(info, "preview", vs->tally_preview ? json_true() : json_false());
+				json_object_set_new(info, "program", vs->tally_program ? json_true() : json_false());
+				gateway->notify_event(&janus_ndi_plugin, session->handle, info);
 			}
 		}
+	}
 
-		/* Let's start with audio */
-		janus_mutex_lock(&session->mutex);
-		janus_ndi_buffer_packet *pkt = session->audio_buffered_packets ? g_queue_peek_head(session->audio_buffered_packets) : NULL;
-		janus_mutex_unlock(&session->mutex);
-		while(pkt != NULL && ((now - pkt->inserted) >= buffer_size)) {
-			JANUS_LOG(LOG_HUGE, "[%s] Decoding Opus packet (audio)\n", session->ndi_name);
+	/* Audio is taken care of by a separate task, let's handle video */
+	janus_ndi_buffer_packet *pkt = janus_ndi_jitter_buffer_peek(&session->video_jb, &missing);
+	if(pkt != NULL && now >= janus_ndi_video_packet_due(session, vs, pkt, missing, delay)) {
+		/* Time to decode this packet(s), get all the packets with the same timestamp */
+		vs->last_ts = pkt->timestamp;
+		if(vs->prevts_set) {
+			/* The previous round didn't give us a complete frame, keep looking for the same timestamp */
+			vs->prevts_set = FALSE;
+			vs->last_ts = vs->prev_ts;
+		} else {
+			vs->gaps = 0;
+			vs->truncated = FALSE;
+			janus_ndi_frame_info_reset(&vs->finfo);
+		}
+		while(pkt != NULL) {
 			packet = NULL;
 			bytes = 0;
-			done_something = TRUE;
-			janus_mutex_lock(&session->mutex);
-			pkt = g_queue_pop_head(session->audio_buffered_packets);
-			janus_mutex_unlock(&session->mutex);
-			/* We need this packet now, decode it */
+			pkt = janus_ndi_jitter_buffer_peek(&session->video_jb, &missing);
+			if(pkt == NULL || now < janus_ndi_video_packet_due(session, vs, pkt, missing, delay))
+				break;
+			/* Decode the packet */
 			packet = pkt->buffer;
 			bytes = pkt->len;
-			payload = janus_rtp_payload(packet, bytes, &plen);
-			/* Decode the audio packet */
-			int res = opus_decode(session->audiodec, (const unsigned char *)payload, plen,
-				opus_samples, 960*4, 0);
-			if(res < 0) {
-				JANUS_LOG(LOG_ERR, "[%s] Ops! got an error decoding the Opus frame (%d bytes): %d (%s)\n",
-					session->ndi_name, plen, res, opus_strerror(res));
-			} else if(g_atomic_int_get(&session->audio) && !g_atomic_int_get(&session->paused)) {
-				/* Send via NDI as interleaved audio */
-				NDIlib_audio_frame_interleaved_16s_t NDI_audio_frame = { 0 };
-				NDI_audio_frame.sample_rate = 48000;
-				NDI_audio_frame.no_channels = 2;
-				NDI_audio_frame.no_samples = 960;
-				NDI_audio_frame.p_data = (short *)opus_samples;
-				NDI_audio_frame.timecode = NDIlib_send_timecode_synthesize;
-				janus_mutex_lock(&session->ndi_sender->mutex);
-				NDIlib_util_send_send_audio_interleaved_16s(session->ndi_sender->instance, &NDI_audio_frame);
-				janus_mutex_unlock(&session->ndi_sender->mutex);
-			}
-			/* Get rid of the buffered packet */
-			janus_ndi_buffer_packet_destroy(pkt);
-			/* Peek the next packet */
-			janus_mutex_lock(&session->mutex);
-			pkt = g_queue_peek_head(session->audio_buffered_packets);
-			janus_mutex_unlock(&session->mutex);
-		}
-		/* Now move to video */
-		janus_mutex_lock(&session->mutex);
-		pkt = session->video_buffered_packets ? g_queue_peek_head(session->video_buffered_packets) : NULL;
-		janus_mutex_unlock(&session->mutex);
-		if(pkt != NULL && ((now - pkt->inserted) >= buffer_size)) {
-			/* Time to decode this packet(s), get all the packets with the same timestamp */
-			last_ts = pkt->timestamp;
-			if(prevts_set) {
-				/* The previous round didn't give us a complete frame, keep looking for the same timestamp */
-				prevts_set = FALSE;
-				last_ts = prev_ts;
+			janus_rtp_header *rtp = (janus_rtp_header *)packet;
+			if(pkt->timestamp == vs->last_ts) {
+				/* Timestamp we're interested in, pop the packet */
+				done_something = TRUE;
+				(void)janus_ndi_jitter_buffer_pop(&session->video_jb, &missing);
+				janus_ndi_video_packet_popped(session, vs, pkt);
+				JANUS_LOG(LOG_HUGE, "[%s] Processing video RTP packet: ts=%"SCNu32", seq=%"SCNu16", ins=%"SCNu64"\n",
+					session->ndi_name, pkt->timestamp, pkt->seq_number, pkt->inserted);
+				if(!vs->prevts_set) {
+					/* Let's keep track of this timestamp */
+					vs->prevts_set = TRUE;
+					vs->prev_ts = vs->last_ts;
+				}
+				/* Also check if there's gaps in the sequence number */
+				if(session->strict_decoder && missing > 0) {
+					/* FIXME Should we drop this packet? */
+					vs->gaps += MIN(missing, 255 - vs->gaps);
+					JANUS_LOG(LOG_WARN, "[%s] Detected %"SCNu16" missing packet(s) (%"SCNu16", expecting %"SCNu16")\n",
+						session->ndi_name, missing, pkt->seq_number, (uint16_t)(pkt->seq_number-missing));
+				}
 			} else {
-				gaps = 0;
-			}
-			while(pkt != NULL) {
+				/* Timestamp of another packet, stop here after we've decoded the previous one */
+				pkt = NULL;
 				packet = NULL;
 				bytes = 0;
-				janus_mutex_lock(&session->mutex);
-				pkt = g_queue_peek_head(session->video_buffered_packets);
-				janus_mutex_unlock(&session->mutex);
-				if(pkt == NULL || ((now - pkt->inserted) < buffer_size))
-					break;
-				/* Decode the packet */
-				packet = pkt->buffer;
-				bytes = pkt->len;
-				janus_rtp_header *rtp = (janus_rtp_header *)packet;
-				if(ntohl(rtp->timestamp) == last_ts) {
-					/* Timestamp we're interested in, pop the packet */
-					done_something = TRUE;
-					janus_mutex_lock(&session->mutex);
-					(void)g_queue_pop_head(session->video_buffered_packets);
-					janus_mutex_unlock(&session->mutex);
-					JANUS_LOG(LOG_HUGE, "[%s] Processing video RTP packet: ts=%"SCNu32", seq=%"SCNu16", ins=%"SCNu64"\n",
-						session->ndi_name, pkt->timestamp, pkt->seq_number, pkt->inserted);
-					if(!prevts_set) {
-						/* Let's keep track of this timestamp */
-						prevts_set = TRUE;
-						prev_ts = last_ts;
-					}
-					/* Also check if there's gaps in the sequence number */
-					if(session->strict_decoder && (int16_t)(pkt->seq_number - max_seq_nr) > 1) {
-						/* FIXME Should we drop this packet? */
-						gaps++;
-						JANUS_LOG(LOG_WARN, "[%s] Detected missing packet (%"SCNu16", expecting %"SCNu16")\n",
-							session->ndi_name, pkt->seq_number, (max_seq_nr+1));
+				vs->ts_changed = TRUE;
+				vs->prevts_set = FALSE;
+				JANUS_LOG(LOG_HUGE, "[%s]   >> Got new video timestamp (%"SCNu32" != %"SCNu32"), stopping here\n",
+					session->ndi_name, ntohl(rtp->timestamp), vs->last_ts);
+			}
+			/* FIXME Check if the timestamp changed and we need to decode */
+			if(vs->got_video && vs->ts_changed && vs->frame_len == 0) {
+				vs->ts_changed = FALSE;
+			} else if(vs->got_video && vs->ts_changed && vs->frame_len > 0) {
+				/* Timestamp changed: we have a whole packet to decode */
+				vs->ts_changed = FALSE;
+				/* Keep track of the time between frames, which is how long
+				 * we're willing to wait for missing packets */
+				if(vs->interval_ts_set) {
+					int32_t diff = (int32_t)(vs->last_ts - vs->interval_ts);
+					if(diff > 0 && diff <= 9000)
+						vs->frame_interval += ((gint64)diff*100/9 - vs->frame_interval)/8;
+				}
+				vs->interval_ts = vs->last_ts;
+				vs->interval_ts_set = TRUE;
+				JANUS_LOG(LOG_HUGE, "[%s]   >> Decoding video frame: ts=%"SCNu32"\n",
+					session->ndi_name, vs->last_ts);
+				/* FIXME Do we have gaps in this packet? */
+				if(vs->gaps > 0) {
+					/* Should we stop here, or just show a warning? */
+					JANUS_LOG(LOG_WARN, "[%s] We're missing at least %"SCNu8" packets in this frame, skipping it\n",
+						session->ndi_name, vs->gaps);
+					if(vs->got_keyframe && janus_ndi_video_frame_lost(session, vs)) {
+						/* Wait for a keyframe */
+						if(!vs->waiting_kf)
+							g_atomic_int_inc(&session->video_keyframe_waits);
+						vs->waiting_kf = TRUE;
+						vs->need_pli = TRUE;
 					}
-					max_seq_nr = pkt->seq_number;
-				} else {
-					/* Timestamp of another packet, stop here after we've decoded the previous one */
-					pkt = NULL;
-					packet = NULL;
-					bytes = 0;
-					ts_changed = TRUE;
-					prevts_set = FALSE;
-					JANUS_LOG(LOG_HUGE, "[%s]   >> Got new video timestamp (%"SCNu32" != %"SCNu32"), stopping here\n",
-						session->ndi_name, ntohl(rtp->timestamp), last_ts);
+					vs->key_frame = FALSE;
+					/* Reset the offset and stop here */
+					vs->frame_len = 0;
+					vs->data_len = 0;
+					janus_ndi_buffer_packet_destroy(pkt);
+					break;
 				}
-				/* FIXME Check if the timestamp changed and we need to decode */
-				if(got_video && ts_changed && frame_len == 0) {
-					ts_changed = FALSE;
-				} else if(got_video && ts_changed && frame_len > 0) {
-					/* Timestamp changed: we have a whole packet to decode */
-					ts_changed = FALSE;
-					JANUS_LOG(LOG_HUGE, "[%s]   >> Decoding video frame: ts=%"SCNu32"\n",
-						session->ndi_name, last_ts);
-					/* FIXME Do we have gaps in this packet? */
-					if(gaps > 0) {
-						/* Should we stop here, or just show a warning? */
-						JANUS_LOG(LOG_WARN, "[%s] We're missing at least %"SCNu8" packets in this frame, skipping it\n",
-							session->ndi_name, gaps);
-						if(got_keyframe) {
-							/* Wait for a keyframe */
-							waiting_kf = TRUE;
-							need_pli = TRUE;
-						}
-						/* Reset the offset and stop here */
-						frame_len = 0;
-						data_len = 0;
-						janus_ndi_buffer_packet_destroy(pkt);
-						break;
+				if(vs->got_keyframe && janus_ndi_video_layer_skip(session, vs)) {
+					/* We don't need this temporal layer for the output frame rate */
+					JANUS_LOG(LOG_HUGE, "[%s] Skipping video frame in temporal layer %d\n",
+						session->ndi_name, vs->finfo.tid);
+					g_atomic_int_inc(&session->video_layer_dropped);
+					/* Reset the offset and stop here */
+					vs->frame_len = 0;
+					vs->data_len = 0;
+					janus_ndi_buffer_packet_destroy(pkt);
+					break;
+				}
+				gboolean waiting_kf = vs->waiting_kf;
+				if(vs->got_keyframe && !janus_ndi_video_frame_decodable(session, vs)) {
+					/* This frame depends on something we lost */
+					if(!waiting_kf && vs->waiting_kf)
+						g_atomic_int_inc(&session->video_keyframe_waits);
+					/* Reset the offset and stop here */
+					vs->frame_len = 0;
+					vs->data_len = 0;
+					janus_ndi_buffer_packet_destroy(pkt);
+					break;
+				}
+				if(vs->data_len > 0) {
+					/* AV1 only: we have a buffered OBU, write the OBU size */
+					size_t written = 0;
+					uint8_t leb[8];
+					janus_ndi_av1_lev128_encode(vs->data_len, leb, &written);
+					JANUS_LOG(LOG_HUGE, "[%s] OBU size (%d): %zu\n", session->ndi_name, vs->data_len, written);
+					janus_ndi_video_state_append(session, vs, leb, written);
+					/* Copy the actual data */
+					JANUS_LOG(LOG_HUGE, "[%s] OBU data: %"SCNu32"\n", session->ndi_name, vs->data_len);
+					janus_ndi_video_state_append(session, vs, vs->obu_data, vs->data_len);
+				}
+				if(vs->truncated) {
+					/* The frame didn't fit in the buffer, no point trying to decode it */
+					JANUS_LOG(LOG_WARN, "[%s] Frame exceeds the maximum buffer size (%d), skipping it\n",
+						session->ndi_name, frame_buffer_max);
+					g_atomic_int_inc(&session->frame_buffer_truncated);
+					if(vs->got_keyframe && janus_ndi_video_frame_lost(session, vs)) {
+						/* Wait for a keyframe */
+						if(!vs->waiting_kf)
+							g_atomic_int_inc(&session->video_keyframe_waits);
+						vs->waiting_kf = TRUE;
+						vs->need_pli = TRUE;
 					}
-					if(got_keyframe && waiting_kf && !key_frame) {
-						/* We're waiting for a keyframe from a previous glitch */
-						JANUS_LOG(LOG_WARN, "[%s] Still waiting for a keyframe to fix the glitch\n", session->ndi_name);
-						/* Reset the offset and stop here */
-						frame_len = 0;
-						data_len = 0;
-						janus_ndi_buffer_packet_destroy(pkt);
-						break;
+					vs->key_frame = FALSE;
+					/* Reset the offset and stop here */
+					vs->frame_len = 0;
+					vs->data_len = 0;
+					janus_ndi_buffer_packet_destroy(pkt);
+					break;
+				}
+				/* Keep track of the largest frame we've seen */
+				if(vs->frame_len > g_atomic_int_get(&session->frame_buffer_hwm))
+					g_atomic_int_set(&session->frame_buffer_hwm, vs->frame_len);
+				memset(vs->received_frame + vs->frame_len, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+				if(vs->got_keyframe) {
+					/* The packet takes our reference to the pooled buffer we reassembled
+					 * the frame in, which means the decoder can keep a reference to it
+					 * rather than copying the data: we'll get a new buffer from the pool
+					 * when we start reassembling the next frame */
+					AVPacket *avpacket = vs->packet;
+					avpacket->buf = vs->frame_buf;
+					avpacket->data = vs->received_frame;
+					avpacket->size = vs->frame_len;
+					vs->frame_buf = NULL;
+					vs->received_frame = NULL;
+					if(vs->key_frame) {
+						avpacket->flags |= AV_PKT_FLAG_KEY;
+						vs->key_frame = FALSE;
+						vs->waiting_kf = FALSE;
+						/* Any request we sent has been answered */
+						g_atomic_int_inc(&session->keyframes_received);
+						janus_ndi_video_keyframe_reset(vs);
+						vs->need_pli = FALSE;
 					}
-					if(data_len > 0) {
-						/* AV1 only: we have a buffered OBU, write the OBU size */
-						size_t written = 0;
-						uint8_t leb[8];
-						janus_ndi_av1_lev128_encode(data_len, leb, &written);
-						JANUS_LOG(LOG_HUGE, "[%s] OBU size (%d): %zu\n", session->ndi_name, data_len, written);
-						memcpy(received_frame + frame_len, leb, written);
-						frame_len += written;
-						/* Copy the actual data */
-						JANUS_LOG(LOG_HUGE, "[%s] OBU data: %"SCNu32"\n", session->ndi_name, data_len);
-						memcpy(received_frame + frame_len, obu_data, data_len);
-						frame_len += data_len;
+					/* We only start decoding after we received the first keyframe: we
+					 * use the time we pass the packet to the decoder as its pts, so that
+					 * we can tell how long it took to get the frame back (which includes
+					 * the frames frame threading keeps in flight) */
+					avpacket->pts = janus_get_monotonic_time();
+					/* The RTP timestamp goes in the dts instead, which the decoder
+					 * hands back in the frame (WebRTC streams have no reordering,
+					 * so decode and presentation order are the same) */
+					avpacket->dts = vs->last_ts;
+					int ret = avcodec_send_packet(session->ctx, avpacket);
+					av_packet_unref(avpacket);
+					if(ret < 0) {
+						JANUS_LOG(LOG_ERR, "[%s] Error decoding video frame... %d (%s)\n",
+							session->ndi_name, ret, av_err2str(ret));
+						/* Schedule a PLI */
+						vs->need_pli = TRUE;
 					}
-					memset(received_frame + frame_len, 0, AV_INPUT_BUFFER_PADDING_SIZE);
-					AVPacket avpacket = { 0 };
-					avpacket.data = received_frame;
-					avpacket.size = frame_len;
-					if(got_keyframe) {
-						if(key_frame) {
-							avpacket.flags |= AV_PKT_FLAG_KEY;
-							key_frame = FALSE;
-							waiting_kf = FALSE;
-						}
-						/* We only start decoding after we received the first keyframe */
-						int ret = avcodec_send_packet(session->ctx, &avpacket);
-						if(ret < 0) {
-							JANUS_LOG(LOG_ERR, "[%s] Error decoding video frame... %d (%s)\n",
+					/* With frame threading the decoder may have more than one frame ready */
+					while(ret >= 0) {
+						ret = avcodec_receive_frame(session->ctx, vs->decoded_frame);
+						if(ret == AVERROR(EAGAIN)) {
+							/* Decoder needs more input */
+							JANUS_LOG(LOG_HUGE, "[%s] Skipping decoding of video frame: %d (%s)\n",
+								session->ndi_name, ret, av_err2str(ret));
+							break;
+						} else if(ret < 0) {
+							JANUS_LOG(LOG_ERR, "[%s] Error decoding video frame: %d (%s)\n",
 								session->ndi_name, ret, av_err2str(ret));
 							/* Schedule a PLI */
-							need_pli = TRUE;
-						} else {
-							ret = avcodec_receive_frame(session->ctx, decoded_frame);
-							if(ret == AVERROR(EAGAIN)) {
-								/* Encoder needs more input? */
-								JANUS_LOG(LOG_VERB, "[%s] Skipping decoding of video frame: %d (%s)\n",
-									session->ndi_name, ret, av_err2str(ret));
-							} else if(ret < 0) {
-								JANUS_LOG(LOG_ERR, "[%s] Error decoding video frame: %d (%s)\n",
-									session->ndi_name, ret, av_err2str(ret));
-								/* Schedule a PLI */
-								need_pli = TRUE;
-							}
+							vs->need_pli = TRUE;
+							break;
 						}
-						frame = decoded_frame;
-						if(ret == 0) {
-							need_pli = FALSE;
-							JANUS_LOG(LOG_HUGE, "[%s] Decoded video frame: %dx%d\n",
-								session->ndi_name, frame->width, frame->height);
-							if(!g_atomic_int_get(&session->video) || g_atomic_int_get(&session->paused)) {
-								/* NDI translation is paused, skip this frame */
-								frame_len = 0;
-								data_len = 0;
-								janus_ndi_buffer_packet_destroy(pkt);
-								continue;
-							}
-							/* Do we need to (re)create the scalers? */
-							if(sws == NULL || frame->width != session->width || frame->height != session->height) {
-								/* We do: get rid of the old ones, if any, and recreate them all */
-								session->width = frame->width;
-								session->height = frame->height;
-								int target_width = session->target_width ? session->target_width : session->width;
-								int target_height = session->target_height ? session->target_height : session->height;
-								/* Create the scaler(s) */
-								JANUS_LOG(LOG_INFO, "[%s] Creating scaler: %dx%d (YUV) --> %dx%d (UYVY)\n",
-									session->ndi_name, frame->width, frame->height, target_width, target_height);
-								if(sws)
-									sws_freeContext(sws);
-								sws = sws_getContext(sws_canvas ? target_width : frame->width, sws_canvas ? target_height : frame->height, AV_PIX_FMT_YUV420P,
-									target_width, target_height, AV_PIX_FMT_UYVY422, SWS_FAST_BILINEAR, NULL, NULL, NULL);
-								if(sws == NULL) {
-									/* TODO What should we do?? */
-									JANUS_LOG(LOG_WARN, "[%s] Couldn't initialize scaler...\n", session->ndi_name);
-									frame_len = 0;
-									data_len = 0;
-									janus_ndi_buffer_packet_destroy(pkt);
-									continue;
-								}
-								/* Recreate the scaled frame too */
-								if(scaled_frame != NULL) {
-									av_free(scaled_frame->data[0]);
-									av_frame_free(&scaled_frame);
-								}
-								scaled_frame = av_frame_alloc();
-								scaled_frame->width = target_width;
-								scaled_frame->height = target_height;
-								scaled_frame->format = AV_PIX_FMT_UYVY422;
-								ret = av_image_alloc(scaled_frame->data, scaled_frame->linesize,
-									scaled_frame->width, scaled_frame->height, AV_PIX_FMT_UYVY422, 1);
-								if(ret < 0) {
-									JANUS_LOG(LOG_WARN, "[%s] Error allocating frame buffer: %d (%s)\n",
-										session->ndi_name, ret, av_err2str(ret));
-									frame_len = 0;
-									data_len = 0;
-									janus_ndi_buffer_packet_destroy(pkt);
-									continue;
-								}
-							}
-							/* Convert the frame to the format we need */
-							sws_scale(sws, (const uint8_t * const*)(canvas ? canvas->data : frame->data), canvas ? canvas->linesize : frame->linesize,
-								0, canvas ? canvas->height : frame->height, scaled_frame->data, scaled_frame->linesize);
-							/* Send via NDI */
-							NDIlib_video_frame_v2_t NDI_video_frame = { 0 };
-							NDI_video_frame.xres = scaled_frame->width;
-							NDI_video_frame.yres = scaled_frame->height;
-							NDI_video_frame.FourCC = NDIlib_FourCC_type_UYVY;
-							NDI_video_frame.p_data = scaled_frame->data[0];
-							NDI_video_frame.line_stride_in_bytes = scaled_frame->linesize[0];
-							NDI_video_frame.timecode = NDIlib_send_timecode_synthesize;
-							NDI_video_frame.frame_format_type = NDIlib_frame_format_type_progressive;
-							janus_mutex_lock(&session->ndi_sender->mutex);
-							if(session->fps > 0) {
-								NDI_video_frame.frame_rate_D = 1;
-								NDI_video_frame.frame_rate_N = session->fps;
-							}
-							session->ndi_sender->last_updated = janus_get_monotonic_time();
-							NDIlib_send_send_video_v2(session->ndi_sender->instance, &NDI_video_frame);
-							janus_mutex_unlock(&session->ndi_sender->mutex);
+						vs->frame = vs->decoded_frame;
+						/* A frame decoded fine, so we don't need a keyframe to recover
+						 * from decode errors, unless we're waiting for one for other
+						 * reasons (lost frames, or temporal layers that didn't resync) */
+						if(!vs->waiting_kf && !vs->broken_layers)
+							vs->need_pli = FALSE;
+						if(vs->frame->pts != AV_NOPTS_VALUE) {
+							/* Update the decode latency stats */
+							gint latency = janus_get_monotonic_time() - vs->frame->pts;
+							gint smoothed = g_atomic_int_get(&session->decode_latency);
+							if(g_atomic_int_add(&session->decoded_frames, 1) == 0)
+								smoothed = latency;
+							else
+								smoothed += (latency - smoothed)/16;
+							g_atomic_int_set(&session->decode_latency, smoothed);
+							if(latency > g_atomic_int_get(&session->decode_latency_max))
+								g_atomic_int_set(&session->decode_latency_max, latency);
 						}
+						JANUS_LOG(LOG_HUGE, "[%s] Decoded video frame: %dx%d\n",
+							session->ndi_name, vs->frame->width, vs->frame->height);
+						if(!g_atomic_int_get(&session->video) || g_atomic_int_get(&session->paused)) {
+							/* NDI translation is paused, skip this frame */
+							continue;
+						}
+						/* Convert the frame (if needed) and send it via NDI */
+						if(janus_ndi_video_send_frame(session, vs) < 0)
+							break;
 					}
-					/* Reset the offset and stop here */
-					frame_len = 0;
-					data_len = 0;
-					janus_ndi_buffer_packet_destroy(pkt);
-					continue;
-				}
-				if(packet == NULL) {
-					janus_ndi_buffer_packet_destroy(pkt);
-					continue;
-				}
-				got_video = TRUE;
-				/* Check what needs to be skipped before getting to the payload */
-				payload = janus_rtp_payload(packet, bytes, &plen);
-				if(!payload || plen < 1) {
-					/* Nothing to do here */
-					JANUS_LOG(LOG_VERB, "[%s] Nothing to decode (%d bytes)\n",
-						session->ndi_name, plen);
-					/* Get rid of the buffered packet */
-					janus_ndi_buffer_packet_destroy(pkt);
-					continue;
 				}
-				if(session->vcodec == JANUS_VIDEOCODEC_VP8) {
-					/* VP8 depay */
-					JANUS_LOG(LOG_HUGE, "[%s]   -- Video packet (VP8)\n", session->ndi_name);
-					/* Read the first octet (VP8 Payload Descriptor) */
-					char *buffer = payload;
-					bytes = plen-1;
-					uint8_t vp8pd = *buffer;
-					uint8_t xbit = (vp8pd & 0x80);
-					uint8_t sbit = (vp8pd & 0x10);
-					/* Read the Extended control bits octet */
-					if(xbit) {
+				/* Reset the offset and stop here */
+				vs->frame_len = 0;
+				vs->data_len = 0;
+				janus_ndi_buffer_packet_destroy(pkt);
+				continue;
+			}
+			if(packet == NULL) {
+				janus_ndi_buffer_packet_destroy(pkt);
+				continue;
+			}
+			vs->got_video = TRUE;
+			/* The payload was already located when we received the packet */
+			payload = packet + pkt->payload;
+			plen = pkt->plen;
+			if(plen < 1) {
+				/* Nothing to do here */
+				JANUS_LOG(LOG_VERB, "[%s] Nothing to decode (%d bytes)\n",
+					session->ndi_name, plen);
+				/* Get rid of the buffered packet */
+				janus_ndi_buffer_packet_destroy(pkt);
+				continue;
+			}
+			if(session->vcodec == JANUS_VIDEOCODEC_VP8) {
+				/* VP8 depay */
+				JANUS_LOG(LOG_HUGE, "[%s]   -- Video packet (VP8)\n", session->ndi_name);
+				/* Read the first octet (VP8 Payload Descriptor) */
+				char *buffer = payload;
+				bytes = plen-1;
+				uint8_t vp8pd = *buffer;
+				uint8_t xbit = (vp8pd & 0x80);
+				uint8_t nbit = (vp8pd & 0x20);
+				uint8_t sbit = (vp8pd & 0x10);
+				/* Take note of what we learn about the frame */
+				janus_ndi_frame_info *finfo = &vs->finfo;
+				finfo->parsed = TRUE;
+				finfo->nonref = (nbit != 0);
+				/* Read the Extended control bits octet */
+				if(xbit) {
+					buffer++;
+					bytes--;
+					vp8pd = *buffer;
+					uint8_t ibit = (vp8pd & 0x80);
+					uint8_t lbit = (vp8pd & 0x40);
+					uint8_t tbit = (vp8pd & 0x20);
+					uint8_t kbit = (vp8pd & 0x10);
+					if(ibit) {
+						/* Read the PictureID octet */
 						buffer++;
 						bytes--;
 						vp8pd = *buffer;
-						uint8_t ibit = (vp8pd & 0x80);
-						uint8_t lbit = (vp8pd & 0x40);
-						uint8_t tbit = (vp8pd & 0x20);
-						uint8_t kbit = (vp8pd & 0x10);
-						if(ibit) {
-							/* Read the PictureID octet */
-							buffer++;
-							bytes--;
-							vp8pd = *buffer;
-							uint16_t picid = vp8pd, wholepicid = picid;
-							uint8_t mbit = (vp8pd & 0x80);
-							if(mbit) {
-								memcpy(&picid, buffer, sizeof(uint16_t));
-								wholepicid = ntohs(picid);
-								picid = (wholepicid & 0x7FFF);
-								buffer++;
-								bytes--;
-							}
-						}
-						if(lbit) {
-							/* Read the TL0PICIDX octet */
-							buffer++;
-							bytes--;
-							vp8pd = *buffer;
-						}
-						if(tbit || kbit) {
-							/* Read the TID/KEYIDX octet */
+						uint16_t picid = vp8pd, wholepicid = picid;
+						uint8_t mbit = (vp8pd & 0x80);
+						finfo->picid = picid;
+						finfo->picid_max = 0x7F;
+						if(mbit) {
+							memcpy(&picid, buffer, sizeof(uint16_t));
+							wholepicid = ntohs(picid);
+							picid = (wholepicid & 0x7FFF);
+							finfo->picid = picid;
+							finfo->picid_max = 0x7FFF;
 							buffer++;
 							bytes--;
-							vp8pd = *buffer;
 						}
 					}
-					buffer++;
-					if(sbit) {
-						unsigned long int vp8ph = 0;
-						memcpy(&vp8ph, buffer, 4);
-						vp8ph = ntohl(vp8ph);
-						uint8_t pbit = ((vp8ph & 0x01000000) >> 24);
-						if(!pbit) {
-							/* Get resolution */
-							unsigned char *c = (unsigned char *)buffer+3;
-							/* vet via sync code */
-							if(c[0]!=0x9d||c[1]!=0x01||c[2]!=0x2a) {
-								JANUS_LOG(LOG_WARN, "[%s] First 3-bytes after header not what they're supposed to be?\n",
-									session->ndi_name);
-							} else {
-								key_frame = TRUE;
-								if(!got_keyframe)
-									got_keyframe = TRUE;
-								uint16_t val3, val5;
-								memcpy(&val3, c+3, sizeof(uint16_t));
-								int vp8w = swap2(val3)&0x3fff;
-								memcpy(&val5, c+5, sizeof(uint16_t));
-								int vp8h = swap2(val5)&0x3fff;
-								/* Check if the resolution is different than the one we knew... */
-								if(width != vp8w || height != vp8h) {
-									/* It is: take note of the new resolution */
-									JANUS_LOG(LOG_INFO, "[%s] VP8 resolution changed (was %dx%d, now is %dx%d)\n",
-										session->ndi_name, width, height, vp8w, vp8h);
-									width = vp8w;
-									height = vp8h;
-								}
-							}
+					if(lbit) {
+						/* Read the TL0PICIDX octet */
+						buffer++;
+						bytes--;
+						vp8pd = *buffer;
+						finfo->tl0picidx = vp8pd;
+					}
+					if(tbit || kbit) {
+						/* Read the TID/KEYIDX octet */
+						buffer++;
+						bytes--;
+						vp8pd = *buffer;
+						if(tbit) {
+							finfo->tid = (vp8pd & 0xC0) >> 6;
+							finfo->sync = ((vp8pd & 0x20) != 0);
 						}
 					}
-					/* Frame manipulation: append the actual payload to the buffer */
-					if(bytes > 0) {
-						if(frame_len + bytes > canvas_size) {
-							JANUS_LOG(LOG_WARN, "[%s] Frame exceeds buffer size...\n",
+				}
+				buffer++;
+				if(sbit) {
+					unsigned long int vp8ph = 0;
+					memcpy(&vp8ph, buffer, 4);
+					vp8ph = ntohl(vp8ph);
+					uint8_t pbit = ((vp8ph & 0x01000000) >> 24);
+					if(!pbit) {
+						/* Get resolution */
+						unsigned char *c = (unsigned char *)buffer+3;
+						/* vet via sync code */
+						if(c[0]!=0x9d||c[1]!=0x01||c[2]!=0x2a) {
+							JANUS_LOG(LOG_WARN, "[%s] First 3-bytes after header not what they're supposed to be?\n",
 								session->ndi_name);
 						} else {
-							memcpy(received_frame + frame_len, buffer, bytes);
-							frame_len += bytes;
+							vs->key_frame = TRUE;
+							if(!vs->got_keyframe)
+								vs->got_keyframe = TRUE;
+							uint16_t val3, val5;
+							memcpy(&val3, c+3, sizeof(uint16_t));
+							int vp8w = swap2(val3)&0x3fff;
+							memcpy(&val5, c+5, sizeof(uint16_t));
+							int vp8h = swap2(val5)&0x3fff;
+							/* Check if the resolution is different than the one we knew... */
+							if(vs->width != vp8w || vs->height != vp8h) {
+								/* It is: take note of the new resolution */
+								JANUS_LOG(LOG_INFO, "[%s] VP8 resolution changed (was %dx%d, now is %dx%d)\n",
+									session->ndi_name, vs->width, vs->height, vp8w, vp8h);
+								vs->width = vp8w;
+								vs->height = vp8h;
+							}
 						}
 					}
-				} else if(session->vcodec == JANUS_VIDEOCODEC_VP9) {
-					/* VP9 depay */
-					JANUS_LOG(LOG_HUGE, "[%s]   -- Video packet (VP9)\n", session->ndi_name);
-					/* Read the first octet (VP9 Payload Descriptor) */
-					char *buffer = payload;
-					bytes = plen;
-					uint8_t vp9pd = *buffer;
-					uint8_t ibit = (vp9pd & 0x80);
-					uint8_t pbit = (vp9pd & 0x40);
-					uint8_t lbit = (vp9pd & 0x20);
-					uint8_t fbit = (vp9pd & 0x10);
-					uint8_t vbit = (vp9pd & 0x02);
-					/* Move to the next octet and see what's there */
+				}
+				/* Frame manipulation: append the actual payload to the buffer */
+				if(bytes > 0)
+					janus_ndi_video_state_append(session, vs, buffer, bytes);
+			} else if(session->vcodec == JANUS_VIDEOCODEC_VP9) {
+				/* VP9 depay */
+				JANUS_LOG(LOG_HUGE, "[%s]   -- Video packet (VP9)\n", session->ndi_name);
+				/* Read the first octet (VP9 Payload Descriptor) */
+				char *buffer = payload;
+				bytes = plen;
+				uint8_t vp9pd = *buffer;
+				uint8_t ibit = (vp9pd & 0x80);
+				uint8_t pbit = (vp9pd & 0x40);
+				uint8_t lbit = (vp9pd & 0x20);
+				uint8_t fbit = (vp9pd & 0x10);
+				uint8_t vbit = (vp9pd & 0x02);
+				/* Take note of what we learn about the frame: in flexible mode
+				 * we know which pictures it depends on, which we only track
+				 * for the base spatial layer */
+				janus_ndi_frame_info *finfo = &vs->finfo;
+				gboolean first = !finfo->parsed;
+				finfo->parsed = TRUE;
+				/* Move to the next octet and see what's there */
+				buffer++;
+				bytes--;
+				if(ibit) {
+					/* Read the PictureID octet */
+					vp9pd = *buffer;
+					uint16_t picid = vp9pd, wholepicid = picid;
+					uint8_t mbit = (vp9pd & 0x80);
+					if(!mbit) {
+						finfo->picid = picid;
+						finfo->picid_max = 0x7F;
+						buffer++;
+						bytes--;
+					} else {
+						memcpy(&picid, buffer, sizeof(uint16_t));
+						wholepicid = ntohs(picid);
+						picid = (wholepicid & 0x7FFF);
+						finfo->picid = picid;
+						finfo->picid_max = 0x7FFF;
+						buffer += 2;
+						bytes -= 2;
+					}
+				}
+				if(lbit) {
+					/* Read the layer indices */
+					vp9pd = *buffer;
+					finfo->tid = (vp9pd & 0xE0) >> 5;
+					finfo->sync = ((vp9pd & 0x10) != 0);
+					if(((vp9pd & 0x0E) >> 1) != 0)
+						first = FALSE;
 					buffer++;
 					bytes--;
-					if(ibit) {
-						/* Read the PictureID octet */
+					if(!fbit) {
+						/* Non-flexible mode, read TL0PICIDX */
+						finfo->tl0picidx = *(uint8_t *)buffer;
+						buffer++;
+						bytes--;
+					}
+				}
+				if(fbit && first)
+					finfo->nrefs = 0;
+				if(fbit && pbit) {
+					/* Read the reference indices */
+					uint8_t nbit = 1;
+					while(nbit) {
 						vp9pd = *buffer;
-						uint16_t picid = vp9pd, wholepicid = picid;
-						uint8_t mbit = (vp9pd & 0x80);
-						if(!mbit) {
-							buffer++;
-							bytes--;
-						} else {
-							memcpy(&picid, buffer, sizeof(uint16_t));
-							wholepicid = ntohs(picid);
-							picid = (wholepicid & 0x7FFF);
-							buffer += 2;
-							bytes -= 2;
-						}
+						nbit = (vp9pd & 0x01);
+						if(first && finfo->nrefs < 3)
+							finfo->refs[finfo->nrefs++] = (vp9pd & 0xFE) >> 1;
+						buffer++;
+						bytes--;
 					}
-					if(lbit) {
+				}
+				if(vbit) {
+					/* Parse and skip SS */
+					vp9pd = *buffer;
+					int n_s = (vp9pd & 0xE0) >> 5;
+					n_s++;
+					uint8_t ybit = (vp9pd & 0x10);
+					uint8_t gbit = (vp9pd & 0x08);
+					if(ybit) {
+						/* Iterate on all spatial layers and get resolution */
 						buffer++;
 						bytes--;
-						if(!fbit) {
-							/* Non-flexible mode, skip TL0PICIDX */
-							buffer++;
-							bytes--;
+						int i=0;
+						for(i=0; i<n_s; i++) {
+							/* Width */
+							uint16_t w;
+							memcpy(&w, buffer, sizeof(uint16_t));
+							int vp9w = ntohs(w);
+							buffer += 2;
+							/* Height */
+							uint16_t h;
+							memcpy(&h, buffer, sizeof(uint16_t));
+							int vp9h = ntohs(h);
+							buffer += 2;
+							bytes -= 4;
+							/* Check if the resolution is different than the one we knew... */
+							if(vs->width != vp9w || vs->height != vp9h) {
+								/* It is: take note of the new resolution */
+								JANUS_LOG(LOG_INFO, "[%s] VP9 resolution changed (was %dx%d, now is %dx%d)\n",
+									session->ndi_name, vs->width, vs->height, vp9w, vp9h);
+								vs->width = vp9w;
+								vs->height = vp9h;
+							}
+							vs->key_frame = TRUE;
+							if(!vs->got_keyframe)
+								vs->got_keyframe = TRUE;
 						}
 					}
-					if(fbit && pbit) {
-						/* Skip reference indices */
-						uint8_t nbit = 1;
-						while(nbit) {
-							vp9pd = *buffer;
-							nbit = (vp9pd & 0x01);
+					if(gbit) {
+						if(!ybit) {
 							buffer++;
 							bytes--;
 						}
-					}
-					if(vbit) {
-						/* Parse and skip SS */
-						vp9pd = *buffer;
-						int n_s = (vp9pd & 0xE0) >> 5;
-						n_s++;
-						uint8_t ybit = (vp9pd & 0x10);
-						uint8_t gbit = (vp9pd & 0x08);
-						if(ybit) {
-							/* Iterate on all spatial layers and get resolution */
-							buffer++;
-							bytes--;
-							int i=0;
-							for(i=0; i<n_s; i++) {
-								/* Width */
-								uint16_t w;
-								memcpy(&w, buffer, sizeof(uint16_t));
-								int vp9w = ntohs(w);
-								buffer += 2;
-								/* Height */
-								uint16_t h;
-								memcpy(&h, buffer, sizeof(uint16_t));
-								int vp9h = ntohs(h);
-								buffer += 2;
-								bytes -= 4;
-								/* Check if the resolution is different than the one we knew... */
-								if(width != vp9w || height != vp9h) {
-									/* It is: take note of the new resolution */
-									JANUS_LOG(LOG_INFO, "[%s] VP9 resolution changed (was %dx%d, now is %dx%d)\n",
-										session->ndi_name, width, height, vp9w, vp9h);
-									width = vp9w;
-									height = vp9h;
+						uint8_t n_g = *buffer;
+						buffer++;
+						bytes--;
+						if(n_g > 0) {
+							uint i=0;
+							for(i=0; i<n_g; i++) {
+								/* Read the R bits */
+								vp9pd = *buffer;
+								int r = (vp9pd & 0x0C) >> 2;
+								if(r > 0) {
+									/* Skip reference indices */
+									buffer += r;
+									bytes -= r;
 								}
-								key_frame = TRUE;
-								if(!got_keyframe)
-									got_keyframe = TRUE;
-							}
-						}
-						if(gbit) {
-							if(!ybit) {
 								buffer++;
 								bytes--;
 							}
-							uint8_t n_g = *buffer;
-							buffer++;
-							bytes--;
-							if(n_g > 0) {
-								uint i=0;
-								for(i=0; i<n_g; i++) {
-									/* Read the R bits */
-									vp9pd = *buffer;
-									int r = (vp9pd & 0x0C) >> 2;
-									if(r > 0) {
-										/* Skip reference indices */
-										buffer += r;
-										bytes -= r;
-									}
-									buffer++;
-									bytes--;
-								}
-							}
 						}
 					}
-					/* Frame manipulation: append the actual payload to the buffer */
-					if(bytes > 0) {
-						if(frame_len + bytes > canvas_size) {
-							JANUS_LOG(LOG_WARN, "[%s] Frame exceeds buffer size...\n",
-								session->ndi_name);
-						} else {
-							memcpy(received_frame + frame_len, buffer, bytes);
-							frame_len += bytes;
-						}
+				}
+				/* Frame manipulation: append the actual payload to the buffer */
+				if(bytes > 0)
+					janus_ndi_video_state_append(session, vs, buffer, bytes);
+			} else if(session->vcodec == JANUS_VIDEOCODEC_H264) {
+				/* H.264 depay */
+				JANUS_LOG(LOG_HUGE, "[%s]   -- Video packet (H.264)\n", session->ndi_name);
+				char *buffer = payload;
+				int len = plen, jump = 0;
+				uint8_t fragment = *buffer & 0x1F;
+				uint8_t nal = *(buffer+1) & 0x1F;
+				uint8_t start_bit = *(buffer+1) & 0x80;
+				if(fragment == 7) {
+					/* SPS, see if we can extract the width/height as well */
+					int h264w = 0, h264h = 0;
+					janus_ndi_h264_parse_sps(buffer, &h264w, &h264h);
+					if(vs->width != h264w || vs->height != h264h) {
+						/* It is: take note of the new resolution */
+						JANUS_LOG(LOG_INFO, "[%s] H.264 resolution changed (was %dx%d, now is %dx%d)\n",
+							session->ndi_name, vs->width, vs->height, h264w, h264h);
+						vs->width = h264w;
+						vs->height = h264h;
 					}
-				} else if(session->vcodec == JANUS_VIDEOCODEC_H264) {
-					/* H.264 depay */
-					JANUS_LOG(LOG_HUGE, "[%s]   -- Video packet (H.264)\n", session->ndi_name);
-					char *buffer = payload;
-					int len = plen, jump = 0;
-					uint8_t fragment = *buffer & 0x1F;
-					uint8_t nal = *(buffer+1) & 0x1F;
-					uint8_t start_bit = *(buffer+1) & 0x80;
-					if(fragment == 7) {
-						/* SPS, see if we can extract the width/height as well */
-						int h264w = 0, h264h = 0;
-						janus_ndi_h264_parse_sps(buffer, &h264w, &h264h);
-						if(width != h264w || height != h264h) {
-							/* It is: take note of the new resolution */
-							JANUS_LOG(LOG_INFO, "[%s] H.264 resolution changed (was %dx%d, now is %dx%d)\n",
-								session->ndi_name, width, height, h264w, h264h);
-							width = h264w;
-							height = h264h;
-						}
-					} else if(fragment == 24) {
-						/* May we find an SPS in this STAP-A? */
-						char *temp = buffer;
-						temp++;
-						int tot = len-1;
-						uint16_t psize = 0;
-						while(tot > 0) {
-							memcpy(&psize, buffer, 2);
-							psize = ntohs(psize);
-							temp += 2;
-							tot -= 2;
-							int nal = *temp & 0x1F;
-							if(nal == 7) {
-								int h264w = 0, h264h = 0;
-								janus_ndi_h264_parse_sps(temp, &h264w, &h264h);
-								if(width != h264w || height != h264h) {
-									/* It is: take note of the new resolution */
-									JANUS_LOG(LOG_INFO, "[%s] H.264 resolution changed (was %dx%d, now is %dx%d)\n",
-										session->ndi_name, width, height, h264w, h264h);
-									width = h264w;
-									height = h264h;
-								}
+				} else if(fragment == 24) {
+					/* May we find an SPS in this STAP-A? */
+					char *temp = buffer;
+					temp++;
+					int tot = len-1;
+					uint16_t psize = 0;
+					while(tot > 0) {
+						memcpy(&psize, buffer, 2);
+						psize = ntohs(psize);
+						temp += 2;
+						tot -= 2;
+						int nal = *temp & 0x1F;
+						if(nal == 7) {
+							int h264w = 0, h264h = 0;
+							janus_ndi_h264_parse_sps(temp, &h264w, &h264h);
+							if(vs->width != h264w || vs->height != h264h) {
+								/* It is: take note of the new resolution */
+								JANUS_LOG(LOG_INFO, "[%s] H.264 resolution changed (was %dx%d, now is %dx%d)\n",
+									session->ndi_name, vs->width, vs->height, h264w, h264h);
+								vs->width = h264w;
+								vs->height = h264h;
 							}
-							temp += psize;
-							tot -= psize;
 						}
+						temp += psize;
+						tot -= psize;
 					}
-					if(fragment == 28 || fragment == 29) {
-						JANUS_LOG(LOG_HUGE, "[%s] Fragment=%d, NAL=%d, Start=%d (len=%d, frame_len=%d)\n",
-							session->ndi_name, fragment, nal, start_bit, len, frame_len);
-					} else {
-						JANUS_LOG(LOG_HUGE, "[%s] Fragment=%d (len=%d, frame_len=%d)\n",
-							session->ndi_name, fragment, len, frame_len);
+				}
+				if(fragment == 28 || fragment == 29) {
+					JANUS_LOG(LOG_HUGE, "[%s] Fragment=%d, NAL=%d, Start=%d (len=%d, frame_len=%d)\n",
+						session->ndi_name, fragment, nal, start_bit, len, vs->frame_len);
+				} else {
+					JANUS_LOG(LOG_HUGE, "[%s] Fragment=%d (len=%d, frame_len=%d)\n",
+						session->ndi_name, fragment, len, vs->frame_len);
+				}
+				if(fragment == 5 ||
+						((fragment == 28 || fragment == 29) && nal == 5 && start_bit == 128)) {
+					JANUS_LOG(LOG_VERB, "[%s] (seq=%"SCNu16", ts=%"SCNu32") Key frame\n",
+						session->ndi_name, ntohs(rtp->seq_number), ntohl(rtp->timestamp));
+					vs->key_frame = TRUE;
+					if(!vs->got_keyframe)
+						vs->got_keyframe = TRUE;
+				}
+				/* Frame manipulation */
+				if((fragment > 0) && (fragment < 24)) {	/* Add a start code */
+					janus_ndi_video_state_append(session, vs, janus_ndi_h264_start_code, 3);
+				} else if(fragment == 24) {	/* STAP-A */
+					/* De-aggregate the NALs and write each of them separately */
+					buffer++;
+					int tot = len-1;
+					uint16_t psize = 0;
+					vs->frame_len = 0;
+					while(tot > 0) {
+						memcpy(&psize, buffer, 2);
+						psize = ntohs(psize);
+						buffer += 2;
+						tot -= 2;
+						/* Now we have a single NAL */
+						janus_ndi_video_state_append(session, vs, janus_ndi_h264_start_code, 3);
+						janus_ndi_video_state_append(session, vs, buffer, psize);
+						/* Go on */
+						buffer += psize;
+						tot -= psize;
 					}
-					if(fragment == 5 ||
-							((fragment == 28 || fragment == 29) && nal == 5 && start_bit == 128)) {
-						JANUS_LOG(LOG_VERB, "[%s] (seq=%"SCNu16", ts=%"SCNu32") Key frame\n",
-							session->ndi_name, ntohs(rtp->seq_number), ntohl(rtp->timestamp));
-						key_frame = TRUE;
-						if(!got_keyframe)
-							got_keyframe = TRUE;
+					len = tot;
+				} else if((fragment == 28) || (fragment == 29)) {	/* FIXME true fr FU-A, not FU-B */
+					uint8_t indicator = *buffer;
+					uint8_t header = *(buffer+1);
+					jump = 2;
+					len -= 2;
+					if(header & 0x80) {
+						/* First part of fragmented packet (S bit set) */
+						uint8_t nal = (indicator & 0xE0) | (header & 0x1F);
+						janus_ndi_video_state_append(session, vs, janus_ndi_h264_start_code, 3);
+						janus_ndi_video_state_append(session, vs, &nal, 1);
+					} else if (header & 0x40) {
+						/* Last part of fragmented packet (E bit set) */
 					}
-					/* Frame manipulation */
-					if((fragment > 0) && (fragment < 24)) {	/* Add a start code */
-						uint8_t *temp = received_frame + frame_len;
-						memset(temp, 0x00, 1);
-						memset(temp + 1, 0x00, 1);
-						memset(temp + 2, 0x01, 1);
-						frame_len += 3;
-					} else if(fragment == 24) {	/* STAP-A */
-						/* De-aggregate the NALs and write each of them separately */
-						buffer++;
-						int tot = len-1;
-						uint16_t psize = 0;
-						frame_len = 0;
-						while(tot > 0) {
-							memcpy(&psize, buffer, 2);
-							psize = ntohs(psize);
-							buffer += 2;
-							tot -= 2;
-							/* Now we have a single NAL */
-							uint8_t *temp = received_frame + frame_len;
-							memset(temp, 0x00, 1);
-							memset(temp + 1, 0x00, 1);
-							memset(temp + 2, 0x01, 1);
-							frame_len += 3;
-							memcpy(received_frame + frame_len, buffer, psize);
-							frame_len += psize;
-							/* Go on */
-							buffer += psize;
-							tot -= psize;
-						}
-						len = tot;
-					} else if((fragment == 28) || (fragment == 29)) {	/* FIXME true fr FU-A, not FU-B */
-						uint8_t indicator = *buffer;
-						uint8_t header = *(buffer+1);
-						jump = 2;
-						len -= 2;
-						if(header & 0x80) {
-							/* First part of fragmented packet (S bit set) */
-							uint8_t *temp = received_frame + frame_len;
-							memset(temp, 0x00, 1);
-							memset(temp + 1, 0x00, 1);
-							memset(temp + 2, 0x01, 1);
-							memset(temp + 3, (indicator & 0xE0) | (header & 0x1F), 1);
-							frame_len += 4;
-						} else if (header & 0x40) {
-							/* Last part of fragmented packet (E bit set) */
-						}
-					}
-					/* Frame manipulation: append the actual payload to the buffer */
-					if(len > 0) {
-						if(frame_len + len > canvas_size) {
-							JANUS_LOG(LOG_WARN, "[%s] Frame exceeds buffer size...\n", session->ndi_name);
-						} else {
-							memcpy(received_frame + frame_len, buffer+jump, len);
-							frame_len += len;
-						}
+				}
+				/* Frame manipulation: append the actual payload to the buffer */
+				if(len > 0)
+					janus_ndi_video_state_append(session, vs, buffer+jump, len);
+			} else if(session->vcodec == JANUS_VIDEOCODEC_AV1) {
+				/* AV1 depay */
+				JANUS_LOG(LOG_HUGE, "[%s]   -- Video packet (AV1)\n", session->ndi_name);
+				char *buffer = payload;
+				int len = plen;
+				uint8_t aggrh = *buffer;
+				uint8_t zbit = (aggrh & 0x80) >> 7;
+				uint8_t ybit = (aggrh & 0x40) >> 6;
+				uint8_t w = (aggrh & 0x30) >> 4;
+				uint8_t nbit = (aggrh & 0x08) >> 3;
+				JANUS_LOG(LOG_HUGE, "[%s]  -- OBU aggregation header: z=%u, y=%u, w=%u, n=%u\n",
+					session->ndi_name, zbit, ybit, w, nbit);
+				/* FIXME Ugly hack: we consider a packet with Z=0 and N=1 a keyframe */
+				vs->key_frame = (!zbit && nbit);
+				if(vs->key_frame && !vs->got_keyframe)
+					vs->got_keyframe = TRUE;
+				buffer++;
+				len--;
+				uint8_t obus = 0;
+				uint32_t obusize = 0;
+				while(!zbit && len > 0) {
+					obus++;
+					if(w == 0 || w > obus) {
+						/* Read the OBU size (leb128) */
+						size_t read = 0;
+						obusize = janus_ndi_av1_lev128_decode((uint8_t *)buffer, len, &read);
+						buffer += read;
+						len -= read;
+					} else {
+						obusize = len;
 					}
-				} else if(session->vcodec == JANUS_VIDEOCODEC_AV1) {
-					/* AV1 depay */
-					JANUS_LOG(LOG_HUGE, "[%s]   -- Video packet (AV1)\n", session->ndi_name);
-					char *buffer = payload;
-					int len = plen;
-					uint8_t aggrh = *buffer;
-					uint8_t zbit = (aggrh & 0x80) >> 7;
-					uint8_t ybit = (aggrh & 0x40) >> 6;
-					uint8_t w = (aggrh & 0x30) >> 4;
-					uint8_t nbit = (aggrh & 0x08) >> 3;
-					JANUS_LOG(LOG_HUGE, "[%s]  -- OBU aggregation header: z=%u, y=%u, w=%u, n=%u\n",
-						session->ndi_name, zbit, ybit, w, nbit);
-					/* FIXME Ugly hack: we consider a packet with Z=0 and N=1 a keyframe */
-					key_frame = (!zbit && nbit);
-					if(key_frame && !got_keyframe)
-						got_keyframe = TRUE;
-					buffer++;
-					len--;
-					uint8_t obus = 0;
-					uint32_t obusize = 0;
-					while(!zbit && len > 0) {
-						obus++;
-						if(w == 0 || w > obus) {
-							/* Read the OBU size (leb128) */
-							size_t read = 0;
-							obusize = janus_ndi_av1_lev128_decode((uint8_t *)buffer, len, &read);
-							buffer += read;
-							len -= read;
-						} else {
-							obusize = len;
-						}
-						/* Then we have the OBU header */
-						char *payload = buffer;
-						uint8_t obuh = *payload;
-						uint8_t fbit = (obuh & 0x80) >> 7;
-						uint8_t type = (obuh & 0x78) >> 3;
-						uint8_t ebit = (obuh & 0x04) >> 2;
-						uint8_t sbit = (obuh & 0x02) >> 1;
-						JANUS_LOG(LOG_HUGE, "[%s]  -- OBU header: f=%u, type=%u, e=%u, s=%u\n",
-							session->ndi_name, fbit, type, ebit, sbit);
-						if(ebit) {
-							/* Skip the extension, if present */
-							payload++;
-							len--;
-							obusize--;
-						}
-						if(type == 1) {
-							/* Sequence header */
-							uint16_t av1w = 0, av1h = 0;
-							/* TODO Fix currently broken parsing of SH */
-							janus_ndi_av1_parse_sh(payload+1, &av1w, &av1h);
-							if(width != av1w || height != av1h) {
-								/* It is: take note of the new resolution */
-								JANUS_LOG(LOG_INFO, "[%s] AV1 resolution changed (was %dx%d, now is %dx%d)\n",
-									session->ndi_name, width, height, av1w, av1h);
-								width = av1w;
-								height = av1h;
-							}
-						}
-						/* Update the OBU header to set the S bit */
-						obuh = *buffer;
-						obuh |= (1 << 1);
-						JANUS_LOG(LOG_HUGE, "[%s] OBU header: 1\n", session->ndi_name);
-						memcpy(received_frame + frame_len, &obuh, sizeof(uint8_t));
-						frame_len++;
-						buffer++;
+					/* Then we have the OBU header */
+					char *payload = buffer;
+					uint8_t obuh = *payload;
+					uint8_t fbit = (obuh & 0x80) >> 7;
+					uint8_t type = (obuh & 0x78) >> 3;
+					uint8_t ebit = (obuh & 0x04) >> 2;
+					uint8_t sbit = (obuh & 0x02) >> 1;
+					JANUS_LOG(LOG_HUGE, "[%s]  -- OBU header: f=%u, type=%u, e=%u, s=%u\n",
+						session->ndi_name, fbit, type, ebit, sbit);
+					if(ebit) {
+						/* Skip the extension, if present */
+						payload++;
 						len--;
 						obusize--;
-						if(w == 0 || w > obus || !ybit) {
-							/* We have the whole OBU, write the OBU size */
-							size_t written = 0;
-							uint8_t leb[8];
-							janus_ndi_av1_lev128_encode(obusize, leb, &written);
-							JANUS_LOG(LOG_HUGE, "[%s] OBU size (%"SCNu32"): %zu\n", session->ndi_name, obusize, written);
-							memcpy(received_frame + frame_len, leb, written);
-							frame_len += written;
-							/* Copy the actual data */
-							JANUS_LOG(LOG_HUGE, "[%s] OBU data: %"SCNu32"\n", session->ndi_name, obusize);
-							memcpy(received_frame + frame_len, buffer, obusize);
-							frame_len += obusize;
-						} else {
-							/* OBU will continue in another packet, buffer the data */
-							JANUS_LOG(LOG_HUGE, "[%s] OBU data (part.): %d\n", session->ndi_name, obusize);
-							memcpy(obu_data + data_len, buffer, obusize);
-							data_len += obusize;
-						}
-						/* Move to the next OBU, if any */
-						buffer += obusize;
-						len -= obusize;
 					}
-					/* Frame manipulation */
-					if(data_len > 0) {
-						if(frame_len + len > canvas_size) {
-							JANUS_LOG(LOG_WARN, "[%s] Frame exceeds buffer size...\n", session->ndi_name);
-						} else {
-							JANUS_LOG(LOG_HUGE, "[%s] OBU data (cont.): %d\n", session->ndi_name, len);
-							memcpy(obu_data + data_len, buffer, len);
-							data_len += len;
+					if(type == 1) {
+						/* Sequence header */
+						uint16_t av1w = 0, av1h = 0;
+						/* TODO Fix currently broken parsing of SH */
+						janus_ndi_av1_parse_sh(payload+1, &av1w, &av1h);
+						if(vs->width != av1w || vs->height != av1h) {
+							/* It is: take note of the new resolution */
+							JANUS_LOG(LOG_INFO, "[%s] AV1 resolution changed (was %dx%d, now is %dx%d)\n",
+								session->ndi_name, vs->width, vs->height, av1w, av1h);
+							vs->width = av1w;
+							vs->height = av1h;
 						}
 					}
+					/* Update the OBU header to set the S bit */
+					obuh = *buffer;
+					obuh |= (1 << 1);
+					JANUS_LOG(LOG_HUGE, "[%s] OBU header: 1\n", session->ndi_name);
+					janus_ndi_video_state_append(session, vs, &obuh, sizeof(uint8_t));
+					buffer++;
+					len--;
+					obusize--;
+					if(w == 0 || w > obus || !ybit) {
+						/* We have the whole OBU, write the OBU size */
+						size_t written = 0;
+						uint8_t leb[8];
+						janus_ndi_av1_lev128_encode(obusize, leb, &written);
+						JANUS_LOG(LOG_HUGE, "[%s] OBU size (%"SCNu32"): %zu\n", session->ndi_name, obusize, written);
+						janus_ndi_video_state_append(session, vs, leb, written);
+						/* Copy the actual data */
+						JANUS_LOG(LOG_HUGE, "[%s] OBU data: %"SCNu32"\n", session->ndi_name, obusize);
+						janus_ndi_video_state_append(session, vs, buffer, obusize);
+					} else {
+						/* OBU will continue in another packet, buffer the data */
+						JANUS_LOG(LOG_HUGE, "[%s] OBU data (part.): %d\n", session->ndi_name, obusize);
+						janus_ndi_video_state_append_obu(session, vs, buffer, obusize);
+					}
+					/* Move to the next OBU, if any */
+					buffer += obusize;
+					len -= obusize;
+				}
+				/* Frame manipulation */
+				if(vs->data_len > 0) {
+					JANUS_LOG(LOG_HUGE, "[%s] OBU data (cont.): %d\n", session->ndi_name, len);
+					janus_ndi_video_state_append_obu(session, vs, buffer, len);
 				}
-				/* Get rid of the buffered packet */
-				janus_ndi_buffer_packet_destroy(pkt);
 			}
+			/* Get rid of the buffered packet */
+			janus_ndi_buffer_packet_destroy(pkt);
 		}
 	}
 
+	/* If we did something, there may be more to do already */
+	if(done_something)
+		return now;
+	/* Figure out when we need to run again (unless we're kicked first):
+	 * the next packet being due, a timer expiring, or wrapping up */
+	gint64 wakeup = vs->tally_last_poll + G_USEC_PER_SEC;
+	if(vs->need_pli && vs->next_pli < wakeup)
+		wakeup = vs->next_pli;
+	if(vs->repeat_at && vs->repeat_at < wakeup)
+		wakeup = vs->repeat_at;
+	if(vs->destroyed && vs->destroyed + delay < wakeup)
+		wakeup = vs->destroyed + delay;
+	janus_ndi_buffer_packet *head = janus_ndi_jitter_buffer_peek(&session->video_jb, &missing);
+	if(head != NULL) {
+		gint64 due = janus_ndi_video_packet_due(session, vs, head, missing, delay);
+		if(due < wakeup)
+			wakeup = due;
+	}
+	return wakeup;
+}
+
+/* Helper to wrap up a session when the video task is done */
+static void janus_ndi_video_task_stop(janus_ndi_session *session) {
+	janus_ndi_video_state *vs = session->video_state;
+
 	/* Also notify event handlers */
 	if(notify_events && gateway->events_is_enabled()) {
 		json_t *info = json_object();
@@ -2838,14 +5151,15 @@ static void *janus_ndi_processing_thread(void *data) {
 	}
 
 	/* In case there's no external sender, send a black box as the last frame */
-	if(!session->external_sender && session->disconnected && scaled_frame != NULL) {
+	if(!session->external_sender && session->disconnected && vs->scaled_frame != NULL) {
 		/* Generate a disconnected image as large as the last frame we sent */
-		int width = scaled_frame->width;
-		int height = scaled_frame->height;
+		int width = vs->scaled_frame->width;
+		int height = vs->scaled_frame->height;
 		AVFrame *goodbye = janus_ndi_generate_disconnected_image(session->disconnected,
 			session->disconnected_color ? session->disconnected_color : "000000", width, height);
 		if(goodbye != NULL) {
-			/* Send via NDI */
+			/* Send via NDI: we send it asynchronously, so that flushing below
+			 * tells us when NDI is done with it, rather than sleeping */
 			NDIlib_video_frame_v2_t NDI_video_frame = { 0 };
 			NDI_video_frame.xres = goodbye->width;
 			NDI_video_frame.yres = goodbye->height;
@@ -2855,27 +5169,21 @@ static void *janus_ndi_processing_thread(void *data) {
 			NDI_video_frame.timecode = NDIlib_send_timecode_synthesize;
 			janus_mutex_lock(&session->ndi_sender->mutex);
 			session->ndi_sender->last_updated = janus_get_monotonic_time();
-			NDIlib_send_send_video_v2(session->ndi_sender->instance, &NDI_video_frame);
+			NDIlib_send_send_video_async_v2(session->ndi_sender->instance, &NDI_video_frame);
 			janus_mutex_unlock(&session->ndi_sender->mutex);
+			vs->async_pending = TRUE;
+			janus_ndi_video_state_flush(vs, session->ndi_sender);
 			/* Destroy the frame */
 			av_free(goodbye->data[0]);
 			av_frame_free(&goodbye);
-			/* Give the frame time to be sent before we destroy the sender */
-			g_usleep(10000);
 		}
 	}
 
-	/* Cleanup resources */
-	g_free(received_frame);
-	av_frame_free(&decoded_frame);
-	if(scaled_frame != NULL) {
-		av_free(scaled_frame->data[0]);
-		av_frame_free(&scaled_frame);
-	}
-	if(sws)
-		sws_freeContext(sws);
-	if(sws_canvas)
-		sws_freeContext(sws_canvas);
+	/* Cleanup resources, making sure NDI doesn't need our frames anymore */
+	janus_ndi_video_state_flush(vs, session->ndi_sender);
+	janus_ndi_jitter_buffer_flush(&session->video_jb);
+	janus_ndi_video_state_free(vs);
+	session->video_state = NULL;
 
 	/* Get rid of the NDI sender */
 	janus_mutex_lock(&sessions_mutex);
@@ -2913,22 +5221,262 @@ static void *janus_ndi_processing_thread(void *data) {
 		av_free(session->ctx);
 		session->ctx = NULL;
 	}
-	if(canvas != NULL) {
-		av_free(canvas->data[0]);
-		av_frame_free(&canvas);
-	}
-
-	JANUS_LOG(LOG_INFO, "[%s] Leaving session thread\n", session->ndi_name);
 
+	JANUS_LOG(LOG_INFO, "[%s] Session tasks done\n", session->ndi_name);
+}
+static void janus_ndi_video_task_done(janus_ndi_task *task) {
+	janus_ndi_session *session = (janus_ndi_session *)task->data;
 	/* Stop tracking the name */
 	g_free(session->ndi_name);
 	session->ndi_name = NULL;
-
-	/* Remove the reference to the session that the thread had */
+	/* Remove the reference to the session that the task had */
 	janus_refcount_decrease(&session->ref);
+}
 
-	g_thread_unref(g_thread_self());
-	return NULL;
+/* Send the planar samples we have pending to NDI: if the session aggregates
+ * or splits audio we only send full frames, keeping what's left for later,
+ * unless we're flushing, otherwise we send everything we have in one frame */
+static void janus_ndi_audio_send_pending(janus_ndi_session *session, gboolean flush) {
+	float *planar = session->audio_pcm + JANUS_NDI_OPUS_MAX_SAMPLES*2;
+	int frame = session->audio_frame_samples;
+	if(frame == 0 || flush)
+		frame = session->audio_pending;
+	int offset = 0;
+	while(frame > 0 && session->audio_pending - offset >= frame) {
+		NDIlib_audio_frame_v3_t NDI_audio_frame = { 0 };
+		NDI_audio_frame.sample_rate = 48000;
+		NDI_audio_frame.no_channels = 2;
+		NDI_audio_frame.no_samples = frame;
+		NDI_audio_frame.FourCC = NDIlib_FourCC_audio_type_FLTP;
+		NDI_audio_frame.p_data = (uint8_t *)(planar + offset);
+		NDI_audio_frame.channel_stride_in_bytes = JANUS_NDI_AUDIO_FIFO_SAMPLES * sizeof(float);
+		NDI_audio_frame.timecode = janus_ndi_session_timecode(session, FALSE, session->audio_pending_ts + offset);
+		NDIlib_send_send_audio_v3(session->ndi_sender->instance, &NDI_audio_frame);
+		g_atomic_int_inc(&session->audio_frames);
+		offset += frame;
+	}
+	/* Move what we didn't send to the beginning of each channel */
+	session->audio_pending -= offset;
+	session->audio_pending_ts += offset;
+	if(offset > 0 && session->audio_pending > 0) {
+		memmove(planar, planar + offset, session->audio_pending * sizeof(float));
+		memmove(planar + JANUS_NDI_AUDIO_FIFO_SAMPLES, planar + JANUS_NDI_AUDIO_FIFO_SAMPLES + offset,
+			session->audio_pending * sizeof(float));
+	}
+	g_atomic_int_set(&session->audio_buffered, session->audio_pending);
+}
+
+/* Create the resampler we use to compensate the audio clock drift: it
+ * doesn't change the sample rate, and also takes care of deinterleaving */
+static struct SwrContext *janus_ndi_audio_resampler_create(void) {
+	struct SwrContext *swr = NULL;
+#if LIBSWRESAMPLE_VERSION_INT >= AV_VERSION_INT(4,5,100)
+	AVChannelLayout stereo = AV_CHANNEL_LAYOUT_STEREO;
+	if(swr_alloc_set_opts2(&swr, &stereo, AV_SAMPLE_FMT_FLTP, 48000,
+			&stereo, AV_SAMPLE_FMT_FLT, 48000, 0, NULL) < 0)
+		return NULL;
+#else
+	swr = swr_alloc_set_opts(NULL, AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_FLTP, 48000,
+		AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_FLT, 48000, 0, NULL);
+	if(swr == NULL)
+		return NULL;
+#endif
+	if(swr_init(swr) < 0) {
+		swr_free(&swr);
+		return NULL;
+	}
+	return swr;
+}
+
+/* Queue decoded (interleaved) samples as planar audio, and send via NDI if
+ * we have enough: if the samples don't follow what we have pending (e.g.,
+ * after DTX or a gap we didn't conceal), we send what we have first, so
+ * that the timecode of each frame still matches its first sample */
+static void janus_ndi_audio_queue(janus_ndi_session *session, uint32_t rtp_ts, int samples) {
+	float *interleaved = session->audio_pcm, *planar = session->audio_pcm + JANUS_NDI_OPUS_MAX_SAMPLES*2;
+	if(session->audio_pending > 0 && rtp_ts != session->audio_queue_ts)
+		janus_ndi_audio_send_pending(session, TRUE);
+	if(session->audio_pending == 0)
+		session->audio_pending_ts = rtp_ts;
+	session->audio_queue_ts = rtp_ts + samples;
+	float *left = planar + session->audio_pending;
+	float *right = planar + JANUS_NDI_AUDIO_FIFO_SAMPLES + session->audio_pending;
+	if(session->audio_swr != NULL) {
+		/* Let the resampler deinterleave the samples, and compensate the drift
+		 * of the sender's clock: we update the compensation once per second,
+		 * keeping track of fractions of samples so that small drifts count too */
+		if(session->audio_compensation_left <= 0) {
+			session->audio_compensation_rest -= session->audio_jb.drift * JANUS_NDI_DRIFT_DISTANCE / 1000000.0;
+			int delta = (int)lrint(session->audio_compensation_rest);
+			session->audio_compensation_rest -= delta;
+			int res = swr_set_compensation(session->audio_swr, delta, JANUS_NDI_DRIFT_DISTANCE);
+			if(res < 0) {
+				JANUS_LOG(LOG_WARN, "[%s] Error compensating audio drift: %d (%s)\n",
+					session->ndi_name, res, av_err2str(res));
+			} else if(delta != 0) {
+				g_atomic_int_add(&session->audio_compensated, delta);
+			}
+			session->audio_compensation_left = JANUS_NDI_DRIFT_DISTANCE;
+		}
+		uint8_t *out[2] = { (uint8_t *)left, (uint8_t *)right };
+		const uint8_t *in[1] = { (const uint8_t *)interleaved };
+		samples = swr_convert(session->audio_swr, out, JANUS_NDI_AUDIO_FIFO_SAMPLES - session->audio_pending, in, samples);
+		if(samples < 0) {
+			JANUS_LOG(LOG_WARN, "[%s] Error resampling audio: %d (%s)\n",
+				session->ndi_name, samples, av_err2str(samples));
+			return;
+		}
+		session->audio_compensation_left -= samples;
+	} else {
+		int i = 0;
+		for(i=0; i<samples; i++) {
+			left[i] = interleaved[2*i];
+			right[i] = interleaved[2*i + 1];
+		}
+	}
+	session->audio_pending += samples;
+	janus_ndi_audio_send_pending(session, FALSE);
+}
+
+/* Fill a gap in the audio before the packet we're about to decode: we try
+ * to recover the tail of the gap from the in-band FEC data in this packet
+ * (only SILK and hybrid packets can carry it), and conceal the rest (PLC),
+ * so that NDI receivers keep getting audio at a steady pace */
+static void janus_ndi_audio_conceal(janus_ndi_session *session, uint32_t rtp_ts, int gap,
+		const unsigned char *payload, int plen, int duration) {
+	int fec = 0;
+	if(plen > 0 && (payload[0] >> 3) < 16 && duration > 0)
+		fec = MIN(duration, gap);
+	int plc = gap - fec;
+	int res = 0;
+	if(plc > 0) {
+		res = opus_decode_float(session->audiodec, NULL, 0, session->audio_pcm, plc, 0);
+		if(res < 0) {
+			JANUS_LOG(LOG_WARN, "[%s] Error concealing %d lost samples: %d (%s)\n",
+				session->ndi_name, plc, res, opus_strerror(res));
+		} else {
+			g_atomic_int_add(&session->audio_concealed, res);
+			janus_ndi_audio_queue(session, rtp_ts - gap, res);
+		}
+	}
+	if(fec > 0) {
+		res = opus_decode_float(session->audiodec, payload, plen, session->audio_pcm, fec, 1);
+		if(res < 0) {
+			JANUS_LOG(LOG_WARN, "[%s] Error decoding FEC for %d lost samples: %d (%s)\n",
+				session->ndi_name, fec, res, opus_strerror(res));
+		} else {
+			g_atomic_int_inc(&session->audio_fec);
+			janus_ndi_audio_queue(session, rtp_ts - res, res);
+		}
+	}
+}
+
+/* Audio processing task: it shares the timing reference (the buffer size)
+ * with the video task, but nothing else. The NDI SDK allows audio and video
+ * to be sent from different threads at the same time, so we don't lock the
+ * sender while sending audio: the video task always waits for this task to
+ * be done before the sender is released */
+static gint64 janus_ndi_audio_task_run(janus_ndi_task *task) {
+	janus_ndi_session *session = (janus_ndi_session *)task->data;
+
+	char *payload = NULL;
+	int plen = 0;
+	uint16_t missing = 0;
+	gboolean sending = FALSE;
+
+	/* If the user has been removed, we need to wrap up */
+	gint64 now = g_get_monotonic_time();
+	gint64 delay = janus_ndi_session_buffer_size(session);
+	if((g_atomic_int_get(&session->destroyed) || g_atomic_int_get(&session->hangup) ||
+			g_atomic_int_get(&stopping)) && session->audio_destroyed == 0)
+		session->audio_destroyed = now;
+	if(session->audio_destroyed && ((now - session->audio_destroyed) >= delay || g_atomic_int_get(&stopping))) {
+		janus_ndi_jitter_buffer_flush(&session->audio_jb);
+		/* Don't lose the tail of the audio we were aggregating */
+		if(session->audio_pending > 0 && g_atomic_int_get(&session->audio) && !g_atomic_int_get(&session->paused))
+			janus_ndi_audio_send_pending(session, TRUE);
+		return -1;
+	}
+	/* Reorder the packets the RTP thread queued in the meanwhile */
+	janus_ndi_buffer_packets_drain(session, FALSE);
+	delay = janus_ndi_session_buffer_size(session);
+	/* Decode and send all the packets that are due */
+	janus_ndi_buffer_packet *pkt = janus_ndi_jitter_buffer_peek(&session->audio_jb, NULL);
+	while(pkt != NULL && ((now - pkt->inserted) >= delay)) {
+		JANUS_LOG(LOG_HUGE, "[%s] Decoding Opus packet (audio)\n", session->ndi_name);
+		pkt = janus_ndi_jitter_buffer_pop(&session->audio_jb, &missing);
+		/* We need this packet now, decode it */
+		payload = pkt->buffer + pkt->payload;
+		plen = pkt->plen;
+		/* Check how many samples this packet contains, as the duration
+		 * of Opus packets can vary (e.g., 10ms, 20ms, 40ms or 60ms) */
+		int res = opus_packet_get_nb_samples((const unsigned char *)payload, plen, 48000);
+		if(res > JANUS_NDI_OPUS_MAX_SAMPLES) {
+			JANUS_LOG(LOG_ERR, "[%s] Invalid Opus frame (%d bytes): %d samples\n",
+				session->ndi_name, plen, res);
+			res = OPUS_INVALID_PACKET;
+		}
+		sending = g_atomic_int_get(&session->audio) && !g_atomic_int_get(&session->paused);
+		/* If packets were lost, fill the gap they left using the RTP
+		 * timestamps, as the duration of the lost packets is unknown */
+		if(missing > 0 && sending && session->audio_next_ts_valid) {
+			int32_t gap = (int32_t)(pkt->timestamp - session->audio_next_ts);
+			if(gap > 0 && gap <= JANUS_NDI_AUDIO_PLC_MAX_SAMPLES) {
+				JANUS_LOG(LOG_HUGE, "[%s] Missing %"SCNu16" audio packets, concealing %"SCNi32" samples\n",
+					session->ndi_name, missing, gap);
+				janus_ndi_audio_conceal(session, pkt->timestamp, gap, (const unsigned char *)payload, plen, res);
+			} else if(gap > 0) {
+				JANUS_LOG(LOG_WARN, "[%s] Missing %"SCNu16" audio packets (%"SCNi32" samples), too many to conceal\n",
+					session->ndi_name, missing, gap);
+			}
+		}
+		/* Decode the audio packet (Opus gives us interleaved samples) */
+		if(res >= 0) {
+			res = opus_decode_float(session->audiodec, (const unsigned char *)payload, plen,
+				session->audio_pcm, JANUS_NDI_OPUS_MAX_SAMPLES, 0);
+		}
+		if(res < 0) {
+			JANUS_LOG(LOG_ERR, "[%s] Ops! got an error decoding the Opus frame (%d bytes): %d (%s)\n",
+				session->ndi_name, plen, res, opus_strerror(res));
+			session->audio_next_ts_valid = FALSE;
+		} else {
+			session->audio_next_ts = pkt->timestamp + res;
+			session->audio_next_ts_valid = TRUE;
+		}
+		if(res >= 0 && sending) {
+			/* Queue as planar float audio, and send via NDI if we have enough */
+			g_atomic_int_inc(&session->audio_packets);
+			janus_ndi_audio_queue(session, pkt->timestamp, res);
+		} else if(!sending && session->audio_pending > 0) {
+			/* We're not sending audio, get rid of what we were aggregating */
+			session->audio_pending = 0;
+			g_atomic_int_set(&session->audio_buffered, 0);
+		}
+		/* Get rid of the buffered packet */
+		janus_ndi_buffer_packet_destroy(pkt);
+		/* Peek the next packet */
+		pkt = janus_ndi_jitter_buffer_peek(&session->audio_jb, NULL);
+	}
+
+	/* Figure out when we need to run again (unless we're kicked first) */
+	gint64 wakeup = 0;
+	if(session->audio_destroyed)
+		wakeup = session->audio_destroyed + delay;
+	if(pkt != NULL && (wakeup == 0 || pkt->inserted + delay < wakeup))
+		wakeup = pkt->inserted + delay;
+	return wakeup;
+}
+static void janus_ndi_audio_task_done(janus_ndi_task *task) {
+	janus_ndi_session *session = (janus_ndi_session *)task->data;
+	g_free(session->audio_pcm);
+	session->audio_pcm = NULL;
+	if(session->audio_swr != NULL)
+		swr_free(&session->audio_swr);
+	/* Let the video task know we're done */
+	g_atomic_int_set(&session->audio_running, 0);
+	janus_ndi_task_kick(&session->video_task);
+	/* Remove the reference to the session that the task had */
+	janus_refcount_decrease(&session->ref);
 }
 
 static void *janus_ndi_send_test_pattern(void *data) {
@@ -2998,51 +5546,20 @@ static void *janus_ndi_send_test_pattern(void *data) {
 	return NULL;
 }
 
-static void *janus_ndi_placeholder_thread(void *data) {
-	janus_ndi_sender *sender = (janus_ndi_sender *)data;
-	if(!sender) {
-		JANUS_LOG(LOG_ERR, "Invalid sender, leaving thread...\n");
-		g_thread_unref(g_thread_self());
-		return NULL;
+/* Placeholder task: we send the placeholder at 30fps, when the sender isn't busy or active */
+static gint64 janus_ndi_placeholder_task_run(janus_ndi_task *task) {
+	janus_ndi_sender *sender = (janus_ndi_sender *)task->data;
+	if(g_atomic_int_get(&sender->destroyed) || g_atomic_int_get(&stopping))
+		return -1;
+	gint64 now = janus_get_monotonic_time();
+	if(sender->next_frame == 0)
+		sender->next_frame = now;
+	if(now < sender->next_frame) {
+		/* Kicked before it was time */
+		return sender->next_frame;
 	}
-	JANUS_LOG(LOG_INFO, "[%s] Starting NDI sender thread\n", sender->name);
-
-	/* We send the placeholder at 30fps, when the sender isn't busy or active */
-	int fps = 30;
-	struct timeval now, before;
-	gettimeofday(&before, NULL);
-	now.tv_sec = before.tv_sec;
-	now.tv_usec = before.tv_usec;
-	time_t passed, d_s, d_us;
-	gint64 nowm = 0;
-
-	while(!g_atomic_int_get(&sender->destroyed)) {
-		/* See if it's time to do something */
-		gettimeofday(&now, NULL);
-		d_s = now.tv_sec - before.tv_sec;
-		d_us = now.tv_usec - before.tv_usec;
-		if(d_us < 0) {
-			d_us += 1000000;
-			--d_s;
-		}
-		passed = d_s*1000000 + d_us;
-		if(passed < (1000000000/(fps*2000))) {
-			usleep(1000);
-			continue;
-		}
-		/* Update the reference time */
-		before.tv_usec += 1000000000/(fps*1000);
-		if(before.tv_usec > 1000000) {
-			before.tv_sec++;
-			before.tv_usec -= 1000000;
-		}
-		janus_mutex_lock(&sender->mutex);
-		nowm = janus_get_monotonic_time();
-		if(nowm < sender->last_updated || (nowm - sender->last_updated < 500000)) {
-			/* Sender is busy, retry later */
-			janus_mutex_unlock(&sender->mutex);
-			continue;
-		}
+	janus_mutex_lock(&sender->mutex);
+	if(now >= sender->last_updated && (now - sender->last_updated >= 500000)) {
 		/* Send via NDI */
 		NDIlib_video_frame_v2_t NDI_video_frame = { 0 };
 		NDI_video_frame.xres = sender->image->width;
@@ -3055,14 +5572,18 @@ static void *janus_ndi_placeholder_thread(void *data) {
 		NDI_video_frame.frame_rate_D = 1;
 		NDI_video_frame.frame_rate_N = 30;
 		NDIlib_send_send_video_v2(sender->instance, &NDI_video_frame);
-		janus_mutex_unlock(&sender->mutex);
 	}
-
-	JANUS_LOG(LOG_INFO, "[%s] Stopping NDI sender thread\n", sender->name);
+	janus_mutex_unlock(&sender->mutex);
+	/* Update the reference time (without trying to catch up if we're late) */
+	sender->next_frame += G_USEC_PER_SEC/30;
+	if(sender->next_frame < now)
+		sender->next_frame = now + G_USEC_PER_SEC/30;
+	return sender->next_frame;
+}
+static void janus_ndi_placeholder_task_done(janus_ndi_task *task) {
+	janus_ndi_sender *sender = (janus_ndi_sender *)task->data;
+	JANUS_LOG(LOG_INFO, "[%s] Stopping NDI sender task\n", sender->name);
 	janus_refcount_decrease(&sender->ref);
-
-	g_thread_unref(g_thread_self());
-	return NULL;
 }
 
 /* Helpers to download an image and decode it to an AVFrame (for placeholders) */
@@ -3470,26 +5991,14 @@ static int janus_ndi_generate_placeholder_image(janus_ndi_sender *sender,
 	janus_mutex_unlock(&sender->mutex);
 	JANUS_LOG(LOG_INFO, "[%s] Created placeholder image: %dx%d, %s\n", sender->name,
 		sender->image->width, sender->image->height, av_get_pix_fmt_name(sender->image->format));
-	/* Finally, let's create a thread for this instance, if we don't have one yet */
-	if(sender->thread != NULL)
+	/* Finally, let's schedule a task for this instance, if we don't have one yet */
+	if(sender->scheduled)
 		return 0;
+	sender->scheduled = TRUE;
 	janus_refcount_increase(&sender->ref);
-	GError *thread_error = NULL;
-	char tname[16];
-	g_snprintf(tname, sizeof(tname), "ndi %s", sender->name);
-	sender->thread = g_thread_try_new(tname, &janus_ndi_placeholder_thread, sender, &thread_error);
-	if(thread_error != NULL) {
-		/* Error spawning thread */
-		JANUS_LOG(LOG_ERR, "[%s] Got error %d (%s) trying to launch the thread...\n",
-			sender->name, thread_error->code, thread_error->message ? thread_error->message : "??");
-		g_error_free(thread_error);
-		janus_refcount_decrease(&sender->ref);
-		if(error_code)
-			*error_code = JANUS_NDI_ERROR_THREAD;
-		if(error_cause && error_cause_len)
-			g_snprintf(error_cause, error_cause_len, "Error launching placeholder thread");
-		return -1;
-	}
+	JANUS_LOG(LOG_INFO, "[%s] Starting NDI sender task\n", sender->name);
+	janus_ndi_task_init(&sender->task, janus_ndi_placeholder_task_run, janus_ndi_placeholder_task_done, sender);
+	janus_ndi_task_kick(&sender->task);
 	/* Done */
 	return 0;
 }